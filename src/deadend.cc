@@ -3,7 +3,7 @@
 #include "regression.h"
 
 
-FSAP::FSAP(PR2State *s, PR2OperatorProxy o) : PolicyItem(s), op(&o) {}
+FSAP::FSAP(PR2State *s, PR2OperatorProxy o) : PolicyItem(s), op(new PR2OperatorProxy(o)) {}
 
 
 void FSAP::dump() const {
@@ -33,42 +33,368 @@ string FSAP::get_name() {
 }
 
 int FSAP::get_index() {
-    return op->get_id();
+    return op->nondet_index;
 }
 
 
+/************************
+ * Relaxed reachability *
+ ************************/
+
+void RelaxedReachability::initialize() {
+
+    const PR2ActionModel &actions = PR2().task->actions;
+
+    for (auto var : PR2().proxy->get_variables()) {
+        fact_offset.push_back(num_facts);
+        num_facts += var.get_domain_size();
+    }
+
+    // One unary operator per effect, with the operator's precondition
+    //  and the effect's conditions as its (deduplicated) preconditions
+    vector< vector<int> > unary_pre;
+    for (int op = 0; op < actions.num_operators(); op++) {
+        for (const auto &eff : actions.get_effects(op)) {
+            vector<int> pre;
+            for (const FactPair &p : actions.get_preconditions(op))
+                pre.push_back(fact(p.var, p.value));
+            for (const FactPair &c : actions.get_conditions(eff))
+                pre.push_back(fact(c.var, c.value));
+            sort(pre.begin(), pre.end());
+            pre.erase(unique(pre.begin(), pre.end()), pre.end());
+
+            if (pre.empty())
+                no_pre_effects.push_back(fact(eff.var, eff.val));
+            unary_num_pre.push_back(pre.size());
+            unary_effect.push_back(fact(eff.var, eff.val));
+            unary_pre.push_back(pre);
+        }
+    }
+
+    // Invert the precondition lists
+    vector<int> count(num_facts, 0);
+    for (auto &pre : unary_pre)
+        for (int f : pre)
+            count[f]++;
+    pre_of_begin.assign(num_facts + 1, 0);
+    for (int f = 0; f < num_facts; f++)
+        pre_of_begin[f + 1] = pre_of_begin[f] + count[f];
+    pre_of.resize(pre_of_begin[num_facts]);
+    vector<int> next(pre_of_begin.begin(), pre_of_begin.end() - 1);
+    for (unsigned u = 0; u < unary_pre.size(); u++)
+        for (int f : unary_pre[u])
+            pre_of[next[f]++] = u;
+
+    reached.resize((num_facts + 63) / 64);
+    is_goal.assign(num_facts, false);
+
+    // A variable is only relevant if one of its facts can enable a
+    //  unary operator or is part of the goal
+    var_relevant.assign(fact_offset.size(), false);
+    for (unsigned var = 0; var < fact_offset.size(); var++) {
+        int end = (var + 1 < fact_offset.size()) ? fact_offset[var + 1] : num_facts;
+        for (int f = fact_offset[var]; f < end; f++)
+            if (pre_of_begin[f + 1] > pre_of_begin[f])
+                var_relevant[var] = true;
+    }
+    for (auto &g : PR2().task->original_goal)
+        var_relevant[g.first] = true;
+}
+
+void RelaxedReachability::reach(int f) {
+    uint64_t bit = uint64_t(1) << (f & 63);
+    if (reached[f >> 6] & bit)
+        return;
+    reached[f >> 6] |= bit;
+    worklist.push_back(f);
+    if (trailing)
+        trail_facts.push_back(f);
+    if (is_goal[f])
+        unsolved_goals--;
+}
+
+void RelaxedReachability::reach_var(int var) {
+    int end = (var + 1 < (int)fact_offset.size()) ? fact_offset[var + 1] : num_facts;
+    for (int f = fact_offset[var]; f < end; f++)
+        reach(f);
+}
+
+void RelaxedReachability::propagate() {
+    // Until every goal fact is reached or nothing changes
+    while ((unsolved_goals > 0) && !worklist.empty()) {
+        int f = worklist.back();
+        worklist.pop_back();
+        for (int i = pre_of_begin[f]; i < pre_of_begin[f + 1]; i++) {
+            int u = pre_of[i];
+            if (trailing)
+                trail_ops.push_back(u);
+            if (0 == --remaining_pre[u])
+                reach(unary_effect[u]);
+        }
+    }
+    worklist.clear();
+}
+
+bool RelaxedReachability::start(const PR2State &state, const vector< pair<int,int> > &goal) {
+
+    fill(reached.begin(), reached.end(), 0);
+    remaining_pre = unary_num_pre;
+    worklist.clear();
+    trailing = false;
+
+    for (int f : goal_facts)
+        is_goal[f] = false;
+    goal_facts.clear();
+    unsolved_goals = 0;
+    for (auto &g : goal) {
+        int f = fact(g.first, g.second);
+        if (!is_goal[f]) {
+            is_goal[f] = true;
+            goal_facts.push_back(f);
+            unsolved_goals++;
+        }
+    }
+
+    // Seed with the state (every value for an undefined variable)
+    for (unsigned var = 0; var < fact_offset.size(); var++) {
+        int val = state[var];
+        if (-1 == val)
+            reach_var(var);
+        else
+            reach(fact(var, val));
+    }
+    for (int f : no_pre_effects)
+        reach(f);
+
+    propagate();
+
+    return unsolved_goals > 0;
+}
+
+bool RelaxedReachability::try_unset(vector<int>::const_iterator begin, vector<int>::const_iterator end) {
+
+    assert(unsolved_goals > 0);
+
+    // Only the new facts are propagated, and everything they change is
+    //  recorded so it can be undone if the goal becomes reachable
+    trailing = true;
+    trail_facts.clear();
+    trail_ops.clear();
+
+    for (auto it = begin; it != end; ++it)
+        reach_var(*it);
+    propagate();
+
+    trailing = false;
+
+    if (unsolved_goals > 0)
+        return true;
+
+    for (int f : trail_facts) {
+        reached[f >> 6] &= ~(uint64_t(1) << (f & 63));
+        if (is_goal[f])
+            unsolved_goals++;
+    }
+    for (int u : trail_ops)
+        remaining_pre[u]++;
+
+    return false;
+}
+
+bool RelaxedReachability::is_deadend(const PR2State &state, const vector< pair<int,int> > &goal) {
+    return start(state, goal);
+}
+
+
+/*****************
+ * Deadend cache *
+ *****************/
+
+static void clear_deadend_cache() {
+    PR2().deadend.check_cache = make_unique<DeadendCheckCache>();
+    PR2().deadend.check_cache->goal = PR2().task->original_goal;
+}
+
+static RelaxedReachability &get_reachability() {
+    if (!PR2().deadend.reachability) {
+        PR2().deadend.reachability = make_unique<RelaxedReachability>();
+        PR2().deadend.reachability->initialize();
+    }
+    return *(PR2().deadend.reachability);
+}
+
+static bool hadd_is_deadend(PR2State &state) {
+    PR2().deadend.reachability_heuristic->reset();
+    return (-1 == PR2().deadend.reachability_heuristic->compute_add_and_ff(state));
+}
+
+static bool compute_is_deadend(PR2State &state) {
+    if (PR2().deadend.fast_reachability) {
+        bool result = get_reachability().is_deadend(state, PR2().task->original_goal);
+        // The fixpoint has to agree with h^add, which it replaces
+        assert(result == hadd_is_deadend(state));
+        return result;
+    }
+
+    return hadd_is_deadend(state);
+}
+
+// computed is left false when the result came from the cache
+static bool cached_is_deadend(PR2State &state, bool &computed) {
+
+    computed = true;
+    if (PR2().deadend.cache_size <= 0)
+        return compute_is_deadend(state);
+
+    DeadendCheckCache *cache = PR2().deadend.check_cache.get();
+    if (!cache ||
+        (cache->registry.size() >= PR2().deadend.cache_size) ||
+        (cache->goal != PR2().task->original_goal)) {
+        clear_deadend_cache();
+        cache = PR2().deadend.check_cache.get();
+    }
+
+    int id = cache->registry.find(state);
+    if (-1 != id) {
+        PR2().deadend.cache_hits++;
+        computed = false;
+        return cache->results[id];
+    }
+
+    PR2().deadend.cache_misses++;
+    bool result = compute_is_deadend(state);
+    id = cache->registry.insert(state);
+    assert(id == (int)cache->results.size());
+    cache->results.push_back(result);
+    return result;
+}
+
+static bool cached_is_deadend(PR2State &state) {
+    bool computed;
+    return cached_is_deadend(state, computed);
+}
+
 bool is_deadend(PR2State &state) {
-    PR2.deadend.reachability_heuristic->reset();
-    return (-1 == PR2.deadend.reachability_heuristic->compute_add_and_ff(state));
+
+    bool computed;
+    bool result = cached_is_deadend(state, computed);
+
+    // Remember the deadend so the policy-level checks (e.g., in the FOND
+    //  search and simulator) recognize it without the heuristic. It is
+    //  only queued here: update_deadends adds it with the next batch, so
+    //  the deadend policy is updated once and a generalized version of
+    //  the same state can subsume it.
+    if (result && computed && PR2().deadend.cache_promote && PR2().deadend.states &&
+        !PR2().deadend.states->check_entailed_match(state)) {
+        PR2().deadend.promoted.push_back(new PR2State(state));
+        PR2().deadend.cache_promoted++;
+    }
+
+    return result;
 }
 
 bool is_forbidden(PR2State &state, const PR2OperatorProxy op) {
     vector<OperatorID> ops;
-    PR2.generate_fsap_aware_applicable_ops(state, ops);
+    PR2().generate_fsap_aware_applicable_ops(state, ops);
     return op.is_possibly_applicable(state) && (find(ops.begin(), ops.end(), OperatorID(op.get_id())) == ops.end());
 }
 
+// Whether some FSAP forbids the nondet action in the state. Unlike the
+//  version above, this doesn't compute the applicable ops, and it stops
+//  at the first FSAP for the action that the state entails.
+bool is_forbidden(const PR2State &state, int nondet_index) {
+    if (!PR2().deadend.enabled || !PR2().deadend.policy)
+        return false;
+    return !PR2().deadend.policy->visit_entailed_items<FSAP>(state, [nondet_index](FSAP *fsap) {
+        return !(fsap->op && (fsap->get_index() == nondet_index));
+    });
+}
+
+
+// Unsets as many of the variables in [begin,end) as possible while
+//  keeping the state a deadend, giving exactly what unsetting them one at
+//  a time (in order) would. Because reachability is monotone in the
+//  initial facts, if the whole range can be unset then so could every
+//  variable along the way, so a range is tried in one go and only split
+//  in half (QuickXplain-style) when that fails.
+template <class TryUnset>
+static void generalize_range(vector<int>::const_iterator begin, vector<int>::const_iterator end, TryUnset &try_unset) {
+    if ((begin == end) || try_unset(begin, end) || (end - begin == 1))
+        return;
+    auto mid = begin + (end - begin) / 2;
+    generalize_range(begin, mid, try_unset);
+    generalize_range(mid, end, try_unset);
+}
 
 bool generalize_deadend(PR2State &state) {
 
     // If the whole state isn't recognized as a deadend, then don't bother
     //  looking for a subset of the state
-    if (!is_deadend(state))
+    if (!cached_is_deadend(state))
         return false;
 
-    // We go through each variable and unset it, checking if the relaxed
-    //  reachability is violated.
-    for (unsigned i = 0; i < PR2.general.num_vars; i++) {
-
-        int val = state[i];
-        state[i] = -1;
+#ifndef NDEBUG
+    PR2State original(state);
+#endif
+
+    if (PR2().deadend.fast_reachability) {
+
+        RelaxedReachability &reachability = get_reachability();
+
+        // Variables that can't enable anything in the relaxed task are
+        //  dropped right away; the rest are tried against a single
+        //  fixpoint that only propagates the newly added facts.
+        vector<int> candidates;
+        for (unsigned i = 0; i < PR2().task->num_vars; i++) {
+            if (state.is_undefined(i))
+                continue;
+            if (reachability.is_relevant(i))
+                candidates.push_back(i);
+            else
+                state[i] = -1;
+        }
 
-        // If relaxing variable i causes us to reach the goal, keep it
-        if (!is_deadend(state))
-            state[i] = val;
+        reachability.start(state, PR2().task->original_goal);
+        auto try_unset = [&](vector<int>::const_iterator begin, vector<int>::const_iterator end) {
+            if (!reachability.try_unset(begin, end))
+                return false;
+            for (auto it = begin; it != end; ++it)
+                state[*it] = -1;
+            return true;
+        };
+        generalize_range(candidates.cbegin(), candidates.cend(), try_unset);
+
+    } else {
+
+        // Unset a range of variables, checking if the relaxed
+        //  reachability is violated
+        vector<int> candidates;
+        for (unsigned i = 0; i < PR2().task->num_vars; i++)
+            if (!state.is_undefined(i))
+                candidates.push_back(i);
+
+        auto try_unset = [&](vector<int>::const_iterator begin, vector<int>::const_iterator end) {
+            vector<int> vals;
+            for (auto it = begin; it != end; ++it) {
+                vals.push_back(state[*it]);
+                state[*it] = -1;
+            }
+            if (cached_is_deadend(state))
+                return true;
+            // Relaxing the range lets us reach the goal, so keep it
+            int i = 0;
+            for (auto it = begin; it != end; ++it)
+                state[*it] = vals[i++];
+            return false;
+        };
+        generalize_range(candidates.cbegin(), candidates.cend(), try_unset);
     }
 
-    if (PR2.logging.deadends) {
+    // Generalizing only unsets variables, and what is left is still a deadend
+    assert(original.entails(state));
+    assert(hadd_is_deadend(state));
+
+    if (PR2().logging.deadends) {
         cout << "Found relaxed deadend:" << endl;
         state.dump_pddl();
     }
@@ -76,6 +402,65 @@ bool generalize_deadend(PR2State &state) {
     return true;
 }
 
+// Two items cover the same thing if they are both deadends, or both
+//  forbid the same non-deterministic action
+static bool same_target(FSAP *a, FSAP *b) {
+    if (!a->op || !b->op)
+        return !a->op && !b->op;
+    return a->get_index() == b->get_index();
+}
+
+// Drops the new items that are already covered by an active item in the
+//  policy, or by a new item earlier in the batch, that is at least as
+//  general. If backward subsumption is enabled, the existing items that a
+//  new one makes redundant are deactivated (and removed from the FSAP
+//  index) so they are thrown out at the next rebuild.
+static void remove_subsumed(Policy *policy, list<PolicyItem *> &items) {
+
+    // More general items first, so a batch item can only be covered by
+    //  one that was already accepted
+    items.sort([](PolicyItem *a, PolicyItem *b) { return a->state->size() < b->state->size(); });
+
+    list<PolicyItem *> accepted;
+    for (auto pi : items) {
+
+        FSAP *item = (FSAP*)pi;
+
+        // Anything in the policy that the new item entails is more general
+        bool covered = !policy->visit_entailed_items<FSAP>(*(item->state), [item](FSAP *other) {
+            return !(other->is_active && same_target(item, other));
+        });
+
+        for (auto it = accepted.begin(); !covered && (it != accepted.end()); ++it)
+            covered = same_target(item, (FSAP*)(*it)) && item->state->entails(*((*it)->state));
+
+        if (covered) {
+            PR2().deadend.subsumed_count++;
+            delete item->state;
+            delete item;
+            continue;
+        }
+
+        if (PR2().deadend.backward_subsumption) {
+            policy->visit_consistent_items<FSAP>(*(item->state), false, [item](FSAP *other) {
+                if (other->is_active && same_target(item, other) && other->state->entails(*(item->state))) {
+                    other->is_active = false;
+                    if (other->op) {
+                        vector<FSAP *> *fsaps = PR2().deadend.nondetop2fsaps[other->get_index()];
+                        fsaps->erase(find(fsaps->begin(), fsaps->end(), other));
+                    }
+                    PR2().deadend.backward_subsumed_count++;
+                }
+                return true;
+            });
+        }
+
+        accepted.push_back(item);
+    }
+
+    items.swap(accepted);
+}
+
 void update_deadends(vector< DeadendTuple* > &failed_states) {
 
     list<PolicyItem *> fsaps;
@@ -101,9 +486,9 @@ void update_deadends(vector< DeadendTuple* > &failed_states) {
 
         // Get the regressable operators for the given state.
         vector<PolicyItem *> reg_items;
-        PR2.general.regressable_ops->generate_consistent_items(*failed_state,
+        PR2().task->regressable_ops->generate_consistent_items(*failed_state,
                                                                reg_items,
-                                                               PR2.deadend.regress_trigger_only);
+                                                               PR2().deadend.regress_trigger_only);
 
         // For each operator, create a new deadend avoidance pair
         for (auto item : reg_items) {
@@ -119,9 +504,9 @@ void update_deadends(vector< DeadendTuple* > &failed_states) {
 
         // Check to see if we have any consistent "all-fire" operators
         reg_items.clear();
-        PR2.general.regressable_cond_ops->generate_consistent_items(*failed_state,
+        PR2().task->regressable_cond_ops->generate_consistent_items(*failed_state,
                                                                     reg_items,
-                                                                    PR2.deadend.regress_trigger_only);
+                                                                    PR2().deadend.regress_trigger_only);
 
         // For each operator, create a new deadend avoidance pair
         for (auto item : reg_items) {
@@ -146,24 +531,35 @@ void update_deadends(vector< DeadendTuple* > &failed_states) {
 
     delete dummy_state;
 
-    if (PR2.logging.deadends) {
-        cout << "DEADENDS(" << PR2.logging.id() << "): Adding the following new FSAPS:" << endl;
+    // Bring in the deadends that is_deadend found since the last update
+    for (auto state : PR2().deadend.promoted)
+        deadends.push_back(new Deadend(state));
+    PR2().deadend.promoted.clear();
+
+    if (PR2().deadend.subsumption) {
+        remove_subsumed(PR2().deadend.policy, fsaps);
+        remove_subsumed(PR2().deadend.states, deadends);
+    }
+
+    if (PR2().logging.deadends) {
+        cout << "DEADENDS(" << PR2().logging.id() << "): Adding the following new FSAPS:" << endl;
         for (auto fsap : fsaps)
             fsap->dump();
     }
 
     // Add a pointer from the operator to the newly created fsaps
     for (auto fsap : fsaps)
-        PR2.deadend.nondetop2fsaps[((FSAP*)fsap)->get_index()]->push_back((FSAP*)fsap);
+        PR2().deadend.nondetop2fsaps[((FSAP*)fsap)->get_index()]->push_back((FSAP*)fsap);
+    PR2().deadend.fsap_version++;
 
-    PR2.deadend.policy->update_policy(fsaps);
-    PR2.deadend.states->update_policy(deadends);
+    PR2().deadend.policy->update_policy(fsaps);
+    PR2().deadend.states->update_policy(deadends);
 }
 
 
 
 // void DeadendAwareSuccessorGenerator::generate_applicable_ops(const PR2State &_curr, vector<OperatorID> &ops) const {
-//     if (PR2.deadend.enabled && PR2.deadend.policy) {
+//     if (PR2().deadend.enabled && PR2().deadend.policy) {
 
 //         PR2State curr = PR2State(_curr);
 
@@ -171,8 +567,8 @@ void update_deadends(vector< DeadendTuple* > &failed_states) {
 //         vector<OperatorID> orig_ops;
 //         map<int, PolicyItem *> fsap_map;
 
-//         PR2.generate_orig_applicable_ops(_curr, orig_ops);
-//         PR2.deadend.policy->generate_entailed_items(curr, reg_items);
+//         PR2().generate_orig_applicable_ops(_curr, orig_ops);
+//         PR2().deadend.policy->generate_entailed_items(curr, reg_items);
 
 //         set<int> forbidden;
 //         for (auto item : reg_items) {
@@ -188,15 +584,15 @@ void update_deadends(vector< DeadendTuple* > &failed_states) {
 
 //         vector<int> ruled_out;
 //         for (auto opid : orig_ops) {
-//             if (0 == forbidden.count(PR2.proxy->get_nondet_index(opid)))
+//             if (0 == forbidden.count(PR2().proxy->get_nondet_index(opid)))
 //                 ops.push_back(opid);
-//             else if (PR2.deadend.combine)
-//                 ruled_out.push_back(PR2.proxy->get_nondet_index(opid));
+//             else if (PR2().deadend.combine)
+//                 ruled_out.push_back(PR2().proxy->get_nondet_index(opid));
 //         }
 
 //         // Add this state as a deadend if we have ruled out everything
-//         if (!PR2.weaksearch.limit_states && PR2.deadend.record_online &&
-//              PR2.deadend.combine && (orig_ops.size() > 0) && ops.empty()) {
+//         if (!PR2().weaksearch.limit_states && PR2().deadend.record_online &&
+//              PR2().deadend.combine && (orig_ops.size() > 0) && ops.empty()) {
 
 //             // Combind all of the FSAPs
 //             PR2State *newDE = new PR2State();
@@ -205,7 +601,7 @@ void update_deadends(vector< DeadendTuple* > &failed_states) {
 //             }
 
 //             // Also rule out all of the unapplicable actions
-//             for (const auto & op : PR2.proxy->get_operators()) {
+//             for (const auto & op : PR2().proxy->get_operators()) {
 //                 if (0 == forbidden.count(op.nondet_index)) {
 //                     if (op.is_possibly_applicable(*newDE)) {
 //                         assert (!(op.is_possibly_applicable(curr)));
@@ -217,7 +613,7 @@ void update_deadends(vector< DeadendTuple* > &failed_states) {
 //                 }
 //             }
 
-//             PR2.deadend.combination_count++;
+//             PR2().deadend.combination_count++;
 
 //             vector<DeadendTuple *> failed_states;
 //             failed_states.push_back(new DeadendTuple(newDE, NULL, NULL));
@@ -226,7 +622,7 @@ void update_deadends(vector< DeadendTuple* > &failed_states) {
 
 //     } else {
 
-//         PR2.generate_orig_applicable_ops(_curr, ops);
+//         PR2().generate_orig_applicable_ops(_curr, ops);
 
 //     }
 
@@ -35,7 +35,7 @@ struct FSAP : PolicyItem {
     FSAP(PR2State *s, PR2OperatorProxy o);
     FSAP(PR2State *s) : PolicyItem(s), op(NULL) {}
 
-    ~FSAP() {}
+    ~FSAP() { delete op; }
 
     bool operator< (const FSAP& other) const;
 
@@ -49,10 +49,77 @@ struct Deadend : FSAP {
     void dump() const;
 };
 
+/*******************************************************************
+ * Relaxed reachability check used to detect deadends. It computes
+ * the same thing as running h^add and checking for an unreachable
+ * goal, but as a plain fixpoint: facts are kept in a bitset, every
+ * unary operator (one per effect) counts down its unreached
+ * preconditions, and newly reached facts go on a worklist. There are
+ * no costs, no queue ordering and no FSAP penalties involved.
+ *******************************************************************/
+class RelaxedReachability {
+    vector<int> fact_offset; // First fact id for every variable
+    int num_facts = 0;
+
+    vector<int> unary_num_pre; // Number of (distinct) preconditions of each unary operator
+    vector<int> unary_effect; // Fact achieved by each unary operator
+    vector<int> pre_of_begin; // Offsets into pre_of (one extra at the end)
+    vector<int> pre_of; // The unary operators that have each fact as a precondition
+    vector<int> no_pre_effects; // Effects of the unary operators without preconditions
+
+    // Scratch space for a single check
+    vector<uint64_t> reached; // Bitset of the facts reached so far
+    vector<int> remaining_pre; // Unreached preconditions of every unary operator
+    vector<int> worklist; // Reached facts that haven't been propagated yet
+    vector<bool> is_goal;
+    vector<int> goal_facts;
+    int unsolved_goals = 0;
+
+    // Undo trail for try_unset
+    bool trailing = false;
+    vector<int> trail_facts; // Facts newly reached
+    vector<int> trail_ops; // Unary operators whose count was decremented (once per decrement)
+
+    vector<bool> var_relevant; // Whether the variable's facts can enable anything / are in the goal
+
+    int fact(int var, int val) const { return fact_offset[var] + val; }
+    void reach(int f);
+    void reach_var(int var); // Reach every value of the variable
+    void propagate();
+
+public:
+    void initialize(); // Built from PR2().task->actions
+    bool is_initialized() const { return !fact_offset.empty(); }
+
+    // True if some goal fact can't be reached from the state, where an
+    //  undefined variable can take on every value of its domain.
+    bool is_deadend(const PR2State &state, const vector< pair<int,int> > &goal);
+
+    // Incremental use (for generalizing a deadend): start computes the
+    //  fixpoint for the state (same result as is_deadend), and try_unset
+    //  then adds every value of the given variables to the initial facts.
+    //  The change is kept if the goal is still unreachable (returns true)
+    //  and undone otherwise.
+    bool start(const PR2State &state, const vector< pair<int,int> > &goal);
+    bool try_unset(vector<int>::const_iterator begin, vector<int>::const_iterator end);
+    bool is_relevant(int var) const { return var_relevant[var]; }
+};
+
+// Results of the relaxed reachability check, indexed by the state's id
+//  in the registry. The check always runs against the original goal, so
+//  the cache is dropped if that ever changes, and it is also dropped
+//  once it reaches the size limit.
+struct DeadendCheckCache {
+    PR2StateRegistry registry;
+    vector<bool> results;
+    vector< pair<int,int> > goal;
+};
+
 void update_deadends(vector< DeadendTuple * > &failed_states);
 
 bool is_deadend(PR2State &state);
 bool is_forbidden(PR2State &state, const PR2OperatorProxy op);
+bool is_forbidden(const PR2State &state, int nondet_index);
 
 bool generalize_deadend(PR2State &state);
 
@@ -5,16 +5,17 @@
 PR2State * generate_nondet_successors(PR2State * current_state, const PR2OperatorProxy * op, vector<NondetSuccessor *> &successors) {
 
     PR2State * expected = nullptr;
-    for (auto oid : PR2.general.nondet_mapping[op->nondet_index]) {
-        PR2OperatorProxy o = PR2.proxy->get_operators()[oid];
-        successors.push_back(new NondetSuccessor(current_state->progress(o),
-                                                 (oid == op->get_id()), o.nondet_outcome));
-        if (o == *op)
+    auto outcomes = PR2().task->actions.get_outcomes(op->nondet_index);
+    for (int oid : outcomes) {
+        successors.push_back(new NondetSuccessor(current_state->progress(oid),
+                                                 (oid == op->get_id()),
+                                                 PR2().task->actions.get_nondet_outcome(oid)));
+        if (oid == op->get_id())
             expected = successors.back()->state;
     }
 
     // Make sure that we have the right number of successors and expected state
-    assert(successors.size() == PR2.general.nondet_mapping[op->nondet_index].size());
+    assert(successors.size() == outcomes.size());
     assert(expected);
 
     return expected;
@@ -0,0 +1,78 @@
+#ifndef ACTION_MODEL_H
+#define ACTION_MODEL_H
+
+#include <span>
+#include <vector>
+
+#include "../../task_proxy.h"
+
+class PR2TaskProxy;
+
+/*******************************************************************
+ * A flat copy of the (determinized) operators and their grouping
+ * into non-deterministic actions. It is built once, when the nondet
+ * mappings are generated, so that progression, regression, successor
+ * generation and the simulator can read contiguous arrays instead of
+ * going through FD's proxy layer (and the PR2OperatorProxy lookups)
+ * every time an operator is applied.
+ *******************************************************************/
+struct PR2ActionModel {
+
+    struct Effect {
+        int var;
+        int val;
+        int cond_begin; // Range of the effect's conditions in effect_conditions
+        int cond_end;
+    };
+
+    // Indexed by the deterministic operator id
+    std::vector<int> op_nondet_index; // The non-deterministic action the operator belongs to
+    std::vector<int> op_nondet_outcome; // The outcome id of the operator within that action
+    std::vector<int> op_pre_begin; // Offsets into preconditions (one extra at the end)
+    std::vector<int> op_eff_begin; // Offsets into effects (one extra at the end)
+    std::vector<FactPair> preconditions;
+    std::vector<Effect> effects;
+    std::vector<FactPair> effect_conditions;
+
+    // Indexed by the non-deterministic action id
+    std::vector<int> outcome_begin; // Offsets into outcome_ops (one extra at the end)
+    std::vector<int> outcome_ops; // The deterministic operators making up each action
+    std::vector<int> mask_begin; // Offsets into mask_vars (one extra at the end)
+    std::vector<int> mask_vars; // Variables that must be defined for context-sensitive regression
+
+    // Defined with the rest of the nondet mapping code (pr2.cc)
+    void build(const PR2TaskProxy &proxy);
+
+    int num_operators() const { return op_nondet_index.size(); }
+    int num_nondet_actions() const { return outcome_begin.empty() ? 0 : (int)outcome_begin.size() - 1; }
+
+    int get_nondet_index(int op) const {
+        return ((op >= 0) && (op < num_operators())) ? op_nondet_index[op] : -1;
+    }
+    int get_nondet_outcome(int op) const {
+        return ((op >= 0) && (op < num_operators())) ? op_nondet_outcome[op] : -1;
+    }
+
+    std::span<const FactPair> get_preconditions(int op) const {
+        return std::span<const FactPair>(preconditions.data() + op_pre_begin[op],
+                                         preconditions.data() + op_pre_begin[op + 1]);
+    }
+    std::span<const Effect> get_effects(int op) const {
+        return std::span<const Effect>(effects.data() + op_eff_begin[op],
+                                       effects.data() + op_eff_begin[op + 1]);
+    }
+    std::span<const FactPair> get_conditions(const Effect &eff) const {
+        return std::span<const FactPair>(effect_conditions.data() + eff.cond_begin,
+                                         effect_conditions.data() + eff.cond_end);
+    }
+    std::span<const int> get_outcomes(int nondet_index) const {
+        return std::span<const int>(outcome_ops.data() + outcome_begin[nondet_index],
+                                    outcome_ops.data() + outcome_begin[nondet_index + 1]);
+    }
+    std::span<const int> get_conditional_mask(int nondet_index) const {
+        return std::span<const int>(mask_vars.data() + mask_begin[nondet_index],
+                                    mask_vars.data() + mask_begin[nondet_index + 1]);
+    }
+};
+
+#endif
@@ -22,7 +22,7 @@ FSAPPenalizedFFHeuristic::FSAPPenalizedFFHeuristic(
     utils::Verbosity verb) : RelaxationHeuristic(tasks::AxiomHandlingType::APPROXIMATE_NEGATIVE, task, cache_estimates, desc, verb),
       did_write_overflow_warning(false),
       relaxed_plan(task_proxy.get_operators().size(), false) {
-    if (PR2.logging.verbose)
+    if (PR2().logging.verbose)
         cout << "Initializing FSAP aware FF heuristic..." << endl;
 }
 
@@ -32,15 +32,17 @@ FSAPPenalizedFFHeuristic::~FSAPPenalizedFFHeuristic() {
 void FSAPPenalizedFFHeuristic::enqueue_if_necessary(PropID prop_id, int cost, OpID op_id){
     assert(cost >= 0);
     Proposition *prop = get_proposition(prop_id);
+    if (prop->cost == -1)
+        prop_reached(prop_id);
     if (prop->cost == -1 || prop->cost > cost) {
         prop->cost = cost;
         prop->reached_by = op_id;
         queue.push(cost, prop_id);
     }
-    if (PR2.logging.heuristic) {
+    if (PR2().logging.heuristic) {
         UnaryOperator *op = get_operator(op_id);
         if (op) {
-            cout << "Enquing operator " << PR2.proxy->get_operators()[op->operator_no].get_name() << " at cost " << cost << endl;
+            cout << "Enquing operator " << PR2().proxy->get_operators()[op->operator_no].get_name() << " at cost " << cost << endl;
             cout << "  PRE:";
             for (auto pre : get_preconditions(op->operator_no))
                 cout << "  " << pre;
@@ -82,7 +84,7 @@ void FSAPPenalizedFFHeuristic::reset() {
     goal_propositions.clear();
 
     // Turn the new goals on
-    for (auto varval : PR2.localize.original_goal) {
+    for (auto varval : PR2().task->original_goal) {
         Proposition * prop = get_proposition(varval.first, varval.second);
         prop->is_goal = true;
         goal_propositions.push_back(get_prop_id(varval.first, varval.second));
@@ -92,13 +94,14 @@ void FSAPPenalizedFFHeuristic::reset() {
 // heuristic computation
 void FSAPPenalizedFFHeuristic::setup_exploration_queue() {
     queue.clear();
-    seen_fsaps.clear();
 
     for (Proposition &prop : propositions) {
         prop.cost = -1;
         prop.marked = false;
     }
 
+    setup_fsap_watchers();
+
     // Deal with operators and axioms without preconditions.
     for (UnaryOperator &op : unary_operators) {
         op.unsatisfied_preconditions = op.num_preconditions;
@@ -121,7 +124,7 @@ void FSAPPenalizedFFHeuristic::setup_exploration_queue_state(const PR2State &sta
     // We need to be a bit more careful about going through the var/val
     //  pairs, as we may have undefined variables (which should take on
     //  every value simultaneously).
-    for (VariableProxy var : PR2.proxy->get_variables()) {
+    for (VariableProxy var : PR2().proxy->get_variables()) {
         if (state.is_undefined(var)) {
             for (int val = 0; val < var.get_domain_size(); ++val) {
                 PropID init_prop = get_prop_id(var.get_id(), val);
@@ -134,45 +137,69 @@ void FSAPPenalizedFFHeuristic::setup_exploration_queue_state(const PR2State &sta
     }
 }
 
+void FSAPPenalizedFFHeuristic::build_fsap_index() {
+    indexed_fsaps.clear();
+    fsap_action.clear();
+    fsap_num_facts.clear();
+    prop_watchers.assign(propositions.size(), vector<int>());
+
+    for (auto fsaps : PR2().deadend.nondetop2fsaps) {
+        for (auto fsap : *fsaps) {
+            int id = indexed_fsaps.size();
+            indexed_fsaps.push_back(fsap);
+            fsap_action.push_back(fsap->get_index());
+            fsap_num_facts.push_back(fsap->varvals()->size());
+            for (auto varval : *(fsap->varvals()))
+                prop_watchers[get_prop_id(varval.first, varval.second)].push_back(id);
+        }
+    }
+
+    fsap_index_version = PR2().deadend.fsap_version;
+}
+
+void FSAPPenalizedFFHeuristic::setup_fsap_watchers() {
+    if (!PR2().weaksearch.penalize_potential_fsaps)
+        return;
+
+    if (fsap_index_version != PR2().deadend.fsap_version)
+        build_fsap_index();
+
+    fsap_unreached = fsap_num_facts;
+    enabled_fsaps.assign(PR2().deadend.nondetop2fsaps.size(), 0);
+
+    // FSAPs without any conditions hold from the start
+    for (unsigned i = 0; i < indexed_fsaps.size(); i++)
+        if (0 == fsap_unreached[i])
+            enabled_fsaps[fsap_action[i]]++;
+}
+
+void FSAPPenalizedFFHeuristic::prop_reached(PropID prop_id) {
+    if (!PR2().weaksearch.penalize_potential_fsaps)
+        return;
+
+    for (int id : prop_watchers[prop_id]) {
+        if (0 == --fsap_unreached[id]) {
+            enabled_fsaps[fsap_action[id]]++;
+            if (PR2().logging.heuristic) {
+                cout << "\nFSAP-Heur(" << PR2().logging.id() << "): Penalizing for FSAP (" << indexed_fsaps[id] << "):" << endl;
+                indexed_fsaps[id]->dump();
+            }
+        }
+    }
+}
+
 int FSAPPenalizedFFHeuristic::compute_fsap_penalty(int op_num) {
     // Axioms have a -1 operator number
     if (-1 == op_num)
         return 0;
 
     // Give the option to bypass this (potentially costly) computation
-    if (!PR2.weaksearch.penalize_potential_fsaps)
+    if (!PR2().weaksearch.penalize_potential_fsaps)
         return 0;
 
-    // We'll keep the running total of all the FSAPs found, scaled by the penalty amount
-    int total = 0;
-    for (auto fsap : *(PR2.deadend.nondetop2fsaps[PR2.proxy->get_nondet_index(op_num)])) {
-
-        // If we've already seen it, then we don't need to check the partial state again
-        if (0 != seen_fsaps.count(fsap))
-            total += PR2.weaksearch.fsap_penalty;
-        else {
-
-            // It will only hold if all of the props are already added in the relaxed graph
-            bool holds = true;
-            for (auto varval : *(fsap->varvals())) {
-                if (-1 == get_proposition(varval.first, varval.second)->cost) {
-                    holds = false;
-                    break;
-                }
-            }
-
-            // When it holds, we add the new fsap as being enabled, and increase the penalty
-            if (holds) {
-                seen_fsaps.insert(fsap);
-                total += PR2.weaksearch.fsap_penalty;
-                if (PR2.logging.heuristic) {
-                    cout << "\nFSAP-Heur(" << PR2.logging.id() << "): Penalizing for FSAP (" << fsap << "):" << endl;
-                    fsap->dump();
-                }
-            }
-        }
-    }
-    return total;
+    // Every FSAP whose facts have all been reached in the relaxed graph
+    //  (see prop_reached) is scaled by the penalty amount
+    return PR2().weaksearch.fsap_penalty * enabled_fsaps[PR2().proxy->get_nondet_index(op_num)];
 }
 
 void FSAPPenalizedFFHeuristic::relaxed_exploration() {
@@ -227,7 +254,7 @@ void FSAPPenalizedFFHeuristic::mark_preferred_operators(
                 // Note that we also will only want to do this if the
                 //  action isn't forbidden here. Marking a forbidden
                 //  action as preferred can lead to bad search expansion.
-                if (0 == forbidden_ops.count(PR2.proxy->get_nondet_index(op))) {
+                if (0 == forbidden_ops.count(PR2().proxy->get_nondet_index(op))) {
                     set_preferred(op);
                 }
                 set_preferred(op);
@@ -264,7 +291,7 @@ void FSAPPenalizedFFHeuristic::mark_preferred_operators_and_relaxed_plan(
                     // Note that we also will only want to do this if the
                     //  action isn't forbidden here. Marking a forbidden
                     //  action as preferred can lead to bad search expansion.
-                    if (0 == forbidden_ops.count(PR2.proxy->get_nondet_index(op))) {
+                    if (0 == forbidden_ops.count(PR2().proxy->get_nondet_index(op))) {
                         set_preferred(op);
                     }
                 }
@@ -275,9 +302,9 @@ void FSAPPenalizedFFHeuristic::mark_preferred_operators_and_relaxed_plan(
 
 int FSAPPenalizedFFHeuristic::compute_add_and_ff(const State &state) {
 
-    if (PR2.logging.heuristic) {
-        cout << "\nFSAP-Heur(" << PR2.logging.id() << "): Computing heuristic for the following state:" << endl;
-        PR2.proxy->dump_pddl_state(state);
+    if (PR2().logging.heuristic) {
+        cout << "\nFSAP-Heur(" << PR2().logging.id() << "): Computing heuristic for the following state:" << endl;
+        PR2().proxy->dump_pddl_state(state);
         cout << endl;
     }
 
@@ -294,8 +321,8 @@ int FSAPPenalizedFFHeuristic::compute_add_and_ff(const State &state) {
         increase_cost(total_cost, goal_cost);
     }
     
-    if (PR2.logging.heuristic)
-        cout << "\nFSAP-Heur(" << PR2.logging.id() << "): Heuristic value = " << total_cost << endl;
+    if (PR2().logging.heuristic)
+        cout << "\nFSAP-Heur(" << PR2().logging.id() << "): Heuristic value = " << total_cost << endl;
 
     return total_cost;
 }
@@ -318,8 +345,8 @@ int FSAPPenalizedFFHeuristic::compute_add_and_ff(const PR2State &state) {
 
 int FSAPPenalizedFFHeuristic::compute_heuristic(const State &state) {
 
-    if (PR2.deadend.record_online &&
-        PR2.deadend.online_policy->check_entailed_match(PR2State(state)))
+    if (PR2().deadend.record_online &&
+        PR2().deadend.online_policy->check_entailed_match(PR2State(state)))
         return DEAD_END;
 
     int h = compute_add_and_ff(state);
@@ -327,12 +354,10 @@ int FSAPPenalizedFFHeuristic::compute_heuristic(const State &state) {
 
         // Make sure we don't mark an operator as preferred if it's forbidden
         forbidden_ops.clear();
-        vector<PolicyItem *> reg_items;
-        PR2State * ps = new PR2State(state);
-        PR2.deadend.policy->generate_entailed_items(*ps, reg_items);
-        delete ps;
-        for (auto item : reg_items)
-            forbidden_ops.insert(((FSAP*)item)->get_index());
+        PR2().deadend.policy->visit_entailed_items<FSAP>(PR2State(state), [this](FSAP *fsap) {
+            forbidden_ops.insert(fsap->get_index());
+            return true;
+        });
 
         // Collecting the relaxed plan also sets the preferred operators.
         for (size_t i = 0; i < goal_propositions.size(); ++i)
@@ -350,12 +375,12 @@ int FSAPPenalizedFFHeuristic::compute_heuristic(const State &state) {
         // for (size_t i = 0; i < goal_propositions.size(); ++i)
         //     mark_preferred_operators(state, goal_propositions[i]);
     } else {
-        if (PR2.logging.deadends)
+        if (PR2().logging.deadends)
             cout << "\nHeuristic found deadend!" << endl;
 
-        if (PR2.deadend.record_online) {
-            PR2.deadend.found_online.push_back(new DeadendTuple(new PR2State(state), NULL, NULL));
-            PR2.deadend.online_policy->add_item(new Deadend(new PR2State(state)));
+        if (PR2().deadend.record_online) {
+            PR2().deadend.found_online.push_back(new DeadendTuple(new PR2State(state), NULL, NULL));
+            PR2().deadend.online_policy->add_item(new Deadend(new PR2State(state)));
         }
     }
     return h;
@@ -37,7 +37,21 @@ class FSAPPenalizedFFHeuristic : public relaxation_heuristic::RelaxationHeuristi
     bool did_write_overflow_warning;
 
     set<int> forbidden_ops; // The operators (non-det indices) that are currently forbidden
-    set< FSAP* > seen_fsaps; // Keeps track of the enabled FSAPs during a heuristic computation
+
+    // Watched-fact index for the FSAP penalties: during the exploration
+    //  every FSAP counts down the facts it is still waiting on, and once
+    //  the last one is reached it is enabled for its nondet action.
+    int fsap_index_version = -1; // Value of PR2().deadend.fsap_version that the index was built for
+    vector<FSAP *> indexed_fsaps; // Every FSAP in PR2().deadend.nondetop2fsaps
+    vector<int> fsap_action; // The nondet action each indexed FSAP forbids
+    vector<int> fsap_num_facts; // The number of facts in each indexed FSAP
+    vector< vector<int> > prop_watchers; // The indexed FSAPs that mention each proposition
+    vector<int> fsap_unreached; // Facts each FSAP is still waiting on (per computation)
+    vector<int> enabled_fsaps; // Number of enabled FSAPs for each nondet action (per computation)
+
+    void build_fsap_index();
+    void setup_fsap_watchers();
+    void prop_reached(PropID prop_id);
 
     // Relaxed plans are represented as a set of operators implemented
     // as a bit vector.
@@ -4,61 +4,186 @@
 
 #include "../../axioms.h"
 #include "../../utils/hash.h"
+#include "../../utils/rng.h"
 
 #include <algorithm>
+#include <bit>
 #include <iostream>
 #include <cassert>
 
+// The layout belongs to the task of the current context
+static inline const PR2StatePacker &packer() { return PR2().task->packer; }
+
+void PR2StatePacker::initialize(const std::vector<int> &domain_sizes) {
+    if (is_initialized())
+        return;
+
+    // Greedily fill the words in variable order, starting a new word
+    //  whenever the next field would not fit.
+    int word = 0;
+    int shift = 0;
+    field_lsb.assign(1, 0);
+    for (int domain_size : domain_sizes) {
+        assert(domain_size > 0);
+        int bits = 1;
+        while ((bits < 63) && ((1LL << bits) < domain_size))
+            bits++;
+
+        if (shift + bits > 64) {
+            word++;
+            shift = 0;
+            field_lsb.push_back(0);
+        }
+
+        uint64_t mask = ((uint64_t(1) << bits) - 1) << shift;
+        var_info.push_back({word, shift, mask});
+        field_lsb[word] |= uint64_t(1) << shift;
+        shift += bits;
+    }
+    num_words = domain_sizes.empty() ? 0 : word + 1;
+}
+
+int PR2State::get(int var) const {
+    return packer().get(values(), defined(), var);
+}
+
+void PR2State::set(int var, int val) {
+    unpacked_values.clear();
+    if (_varvals) {
+        delete _varvals;
+        _varvals = NULL;
+    }
+    packer().set(values(), defined(), var, val);
+}
+
+void PR2State::unpack() const {
+    if ((int)unpacked_values.size() != packer().get_num_vars()) {
+        unpacked_values.resize(packer().get_num_vars());
+        for (int i = 0; i < packer().get_num_vars(); i++)
+            unpacked_values[i] = get(i);
+    }
+}
+
 PR2State & PR2State::operator=(const PR2State &other) {
     if (this != &other) {
-        vars = other.vars;
+        words = other.words;
+        unpacked_values.clear();
+        if (_varvals) {
+            delete _varvals;
+            _varvals = NULL;
+        }
     }
 
     return *this;
 }
 
 PR2State::PR2State() {
-    vars.assign(PR2.general.num_vars, -1);
+    words.assign(2 * packer().get_num_words(), 0);
 }
 
 PR2State::PR2State(std::vector<int> init_vals) {
-    vars = init_vals;
+    words.assign(2 * packer().get_num_words(), 0);
+    for (unsigned i = 0; i < init_vals.size(); i++)
+        set(i, init_vals[i]);
 }
 
 PR2State::PR2State(const State &state) {
-    // _allocate();
+    // The initial state may be built before the planner sets things up,
+    //  so make sure the layout exists.
+    if (!packer().is_initialized())
+        PR2().initialize_layout(state);
+
+    words.assign(2 * packer().get_num_words(), 0);
     for (auto var : state)
-        vars[var.get_variable().get_id()] = var.get_value();
+        set(var.get_variable().get_id(), var.get_value());
 }
 
 PR2State::PR2State(const PR2State &state) {
-    vars = state.vars;
+    words = state.words;
 }
 
-PR2State::~PR2State() {}
+#ifndef NDEBUG
+// Every value of every variable has to read back as it was written,
+//  without touching the neighbouring fields, and the word-parallel
+//  entails / consistent_with / size have to agree with a plain check
+//  over the values (on states drawn with a fixed seed).
+void PR2State::check_packing(const std::vector<int> &domain_sizes) {
+
+    int num_vars = domain_sizes.size();
+
+    PR2State state;
+    for (int var = 0; var < num_vars; var++)
+        state[var] = domain_sizes[var] - 1;
+
+    for (int var = 0; var < num_vars; var++) {
+        for (int val = -1; val < domain_sizes[var]; val++) {
+            state[var] = val;
+            assert(state[var] == val);
+            assert((0 == var) || (state[var - 1] == domain_sizes[var - 1] - 1));
+            assert((num_vars - 1 == var) || (state[var + 1] == domain_sizes[var + 1] - 1));
+        }
+        state[var] = domain_sizes[var] - 1;
+    }
+
+    utils::RandomNumberGenerator rng(2023);
+    for (int trial = 0; trial < 100; trial++) {
+
+        PR2State a, b;
+        int defined = 0;
+        for (int var = 0; var < num_vars; var++) {
+            a[var] = rng.random(domain_sizes[var] + 1) - 1;
+            defined += (-1 != a[var]);
+            // b mostly agrees with a, so that entailment comes up
+            b[var] = (rng.random(4) > 0) ? -1 : a[var];
+            if ((var % 7 == trial % 7) && (domain_sizes[var] > 1))
+                b[var] = rng.random(domain_sizes[var] + 1) - 1;
+        }
+        assert(a.size() == defined);
+
+        bool entails = true, consistent = true;
+        for (int var = 0; var < num_vars; var++) {
+            if ((-1 != b[var]) && (a[var] != b[var]))
+                entails = false;
+            if ((-1 != a[var]) && (-1 != b[var]) && (a[var] != b[var]))
+                consistent = false;
+        }
+        assert(a.entails(b) == entails);
+        assert(a.consistent_with(b) == consistent);
+        assert(b.consistent_with(a) == consistent);
+    }
+}
+#endif
+
+PR2State::~PR2State() {
+    if (_varvals)
+        delete _varvals;
+}
 
 int PR2State::size() const {
     int count = 0;
-    for (unsigned i = 0; i < PR2.general.num_vars; i++) {
-        if (vars[i] != -1)
-            count++;
-    }
+    const uint64_t *def = defined();
+    const PR2StatePacker &layout = packer();
+    for (int w = 0; w < num_words(); w++)
+        count += std::popcount(def[w] & layout.get_field_lsb(w));
     return count;
 }
 
 vector< pair<int,int> > * PR2State::varvals() {
     if (NULL == _varvals) {
         _varvals = new vector< pair<int,int> >();
-        for (int i = 0; i < (int) PR2.general.num_vars; i++)
-            if (-1 != vars[i])
-                _varvals->push_back(make_pair(i,vars[i]));
+        int num_vars = packer().get_num_vars();
+        for (int i = 0; i < num_vars; i++) {
+            int val = get(i);
+            if (-1 != val)
+                _varvals->push_back(make_pair(i,val));
+        }
     }
     return _varvals;
 }
 
-bool PR2State::triggers(const EffectProxy &effect) {
-    for (auto cond : effect.get_conditions()) {
-        if (vars[cond.get_variable().get_id()] != cond.get_value())
+bool PR2State::triggers(const PR2ActionModel::Effect &effect) const {
+    for (const FactPair &cond : PR2().task->actions.get_conditions(effect)) {
+        if (get(cond.var) != cond.value)
             return false;
     }
     return true;
@@ -68,11 +193,17 @@ PR2State * PR2State::progress(const PR2OperatorProxy &op) {
 
     assert(!op.is_axiom());
 
+    return progress(op.get_id());
+
+}
+
+PR2State * PR2State::progress(int op_id) {
+
     PR2State * next = new PR2State(*this);
 
-    for (auto eff : op.get_all_effects()) {
+    for (const auto &eff : PR2().task->actions.get_effects(op_id)) {
         if (triggers(eff))
-            (*next)[eff.get_fact().get_variable().get_id()] = eff.get_fact().get_value();
+            next->set(eff.var, eff.val);
     }
 
     // PR2 TODO : This is disabled since we cannot handle domains with axioms,
@@ -83,43 +214,55 @@ PR2State * PR2State::progress(const PR2OperatorProxy &op) {
 
 }
 
+void PR2State::progress(int op_id, PR2State &next) const {
+
+    next = *this;
+
+    for (const auto &eff : PR2().task->actions.get_effects(op_id)) {
+        if (triggers(eff))
+            next.set(eff.var, eff.val);
+    }
+
+}
+
 PR2State * PR2State::regress(const PR2OperatorProxy &op, PR2State *context) {
 
     assert(!op.is_axiom());
     assert(NULL != context);
 
+    const PR2ActionModel &actions = PR2().task->actions;
+
     PR2State * prev = new PR2State(*this);
 
     // Remove all of the effect settings
-    for (auto eff : op.get_all_effects()) {
+    for (const auto &eff : actions.get_effects(op.get_id())) {
         if (context->triggers(eff)) {
-            int var = eff.get_fact().get_variable().get_id();
-            int val = eff.get_fact().get_value();
 
-            bool inconsistent = (vars[var] != -1) && (vars[var] != val);
+            int cur = get(eff.var);
+            bool inconsistent = (cur != -1) && (cur != eff.val);
 
             if (inconsistent) {
                 cout << "\n\n !! Error: Inconsistent regression !!\n" << endl;
                 // Dump the effect
                 cout << "Effect: " << endl;
-                for (auto cond : eff.get_conditions())
-                    cout << "  " << cond.get_variable().get_id() << " = " << cond.get_value() << endl;
+                for (const FactPair &cond : actions.get_conditions(eff))
+                    cout << "  " << cond.var << " = " << cond.value << endl;
                 dump_pddl();
                 op.dump();
             }
 
             assert(!inconsistent);
-            (*prev)[eff.get_fact().get_variable().get_id()] = -1;
+            prev->set(eff.var, -1);
         }
     }
 
     // Assign the values from the context that are mentioned in conditions
-    for (auto var : *(PR2.general.conditional_mask[op.nondet_index]))
-        (*prev)[var] = (*context)[var];
+    for (int var : actions.get_conditional_mask(op.nondet_index))
+        prev->set(var, context->get(var));
 
     // Add all of the precondition conditions
-    for (auto pre : op.get_preconditions())
-        (*prev)[pre.get_variable().get_id()] = pre.get_value();
+    for (const FactPair &pre : actions.get_preconditions(op.get_id()))
+        prev->set(pre.var, pre.value);
 
     // PR2 TODO : This is disabled since we cannot handle domains with axioms,
     //      leaving it in slows us down.
@@ -129,50 +272,61 @@ PR2State * PR2State::regress(const PR2OperatorProxy &op, PR2State *context) {
 
 }
 
-bool PR2State::entails(const PR2State &other) {
-    for (unsigned i = 0; i < PR2.general.num_vars; i++)
-        if ((other[i] != -1) && (vars[i] != other[i]))
+bool PR2State::entails(const PR2State &other) const {
+    // Everything defined in other must be defined here with the same value
+    const uint64_t *val = values(), *def = defined();
+    const uint64_t *oval = other.values(), *odef = other.defined();
+    for (int w = 0; w < num_words(); w++)
+        if ((odef[w] & ~def[w]) || ((val[w] ^ oval[w]) & odef[w]))
             return false;
     return true;
 }
 
-bool PR2State::consistent_with(const PR2State &other) {
-    for (unsigned i = 0; i < PR2.general.num_vars; i++)
-        if ((other[i] != -1) && (vars[i] != -1) && (vars[i] != other[i]))
+bool PR2State::consistent_with(const PR2State &other) const {
+    // Only the variables defined in both states can disagree
+    const uint64_t *val = values(), *def = defined();
+    const uint64_t *oval = other.values(), *odef = other.defined();
+    for (int w = 0; w < num_words(); w++)
+        if ((val[w] ^ oval[w]) & def[w] & odef[w])
             return false;
     return true;
 }
 
 void PR2State::combine_with(const PR2State &other) {
-    if (_varvals)
+    if (_varvals) {
         delete _varvals;
-    for (unsigned i = 0; i < PR2.general.num_vars; i++) {
-        assert((vars[i] == -1) || (other[i] == -1) || (vars[i] == other[i]));
-        if (other[i] != -1)
-            vars[i] = other[i];
+        _varvals = NULL;
+    }
+    unpacked_values.clear();
+    uint64_t *val = values(), *def = defined();
+    const uint64_t *oval = other.values(), *odef = other.defined();
+    for (int w = 0; w < num_words(); w++) {
+        assert(0 == ((val[w] ^ oval[w]) & def[w] & odef[w]));
+        val[w] = (val[w] & ~odef[w]) | oval[w];
+        def[w] |= odef[w];
     }
 }
 
 void PR2State::dump_pddl() const {
-    if (PR2.logging.disable_state_dump) {
+    if (PR2().logging.disable_state_dump) {
         cout << "  <disabled>" << endl;
         return;
     }
-    for (unsigned i = 0; i < PR2.general.num_vars; i++) {
-        if (-1 != vars[i]) {
-            cout << PR2.proxy->get_fact_name(i, vars[i]) << endl;
+    for (unsigned i = 0; i < PR2().task->num_vars; i++) {
+        if (-1 != get(i)) {
+            cout << PR2().proxy->get_fact_name(i, get(i)) << endl;
         }
     }
 }
 
 void PR2State::dump_fdr() const {
-    if (PR2.logging.disable_state_dump) {
+    if (PR2().logging.disable_state_dump) {
         cout << "  <disabled>" << endl;
         return;
     }
-    for (unsigned i = 0; i < PR2.general.num_vars; i++) {
-        if (-1 != vars[i]) {
-            cout << "  #" << i << " [" << PR2.proxy->get_variable_name(i) << "] -> " << vars[i] << endl;
+    for (unsigned i = 0; i < PR2().task->num_vars; i++) {
+        if (-1 != get(i)) {
+            cout << "  #" << i << " [" << PR2().proxy->get_variable_name(i) << "] -> " << get(i) << endl;
         }
     }
 }
@@ -180,13 +334,13 @@ void PR2State::dump_fdr() const {
 void PR2State::record_snapshot(ofstream &outfile, string indent) {
     outfile << indent << "\"" << this << "\": [" << endl;
     bool first = true;
-    for (unsigned i = 0; i < PR2.general.num_vars; i++) {
-        if (-1 != vars[i]) {
+    for (unsigned i = 0; i < PR2().task->num_vars; i++) {
+        if (-1 != get(i)) {
             if (first)
                 first = false;
             else
                 outfile << "," << endl;
-            outfile << indent << "  \"" << PR2.proxy->get_fact_name(i, vars[i]) << "\"";
+            outfile << indent << "  \"" << PR2().proxy->get_fact_name(i, get(i)) << "\"";
         }
     }
     outfile << endl << indent << "]";
@@ -196,24 +350,73 @@ void PR2State::record_snapshot(ofstream &outfile, string indent) {
 // TODO: Confirm these comparisons are ok.
 
 bool PR2State::operator==(const PR2State &other) const {
-    // unsigned size = PR2.general.num_vars;
-    // return ::equal(vars, vars + size, other.vars);
-    return vars == other.vars;
+    return words == other.words;
 }
 
 bool PR2State::operator<(const PR2State &other) const {
-    // unsigned size = PR2.general.num_vars;
-    // return ::lexicographical_compare(vars, vars + size,
-    //                                  other.vars, other.vars + size);
-    return vars < other.vars;
+    return words < other.words;
 }
 
 
+size_t PR2State::hash() const {
+    utils::HashState hash_state;
+    utils::feed(hash_state, words);
+    return hash_state.get_hash64();
+}
+
+
+PR2StateRegistry::PR2StateRegistry()
+    : table(1024, -1),
+      words_per_state(2 * packer().get_num_words()) {}
+
+int PR2StateRegistry::find_slot(const PR2State &state, size_t h) const {
+    // Linear probing until we hit either the state or an empty slot
+    const uint64_t *words = state.get_packed_words().data();
+    size_t mask = table.size() - 1;
+    for (size_t slot = h & mask; ; slot = (slot + 1) & mask) {
+        int id = table[slot];
+        if ((-1 == id) ||
+            ((hashes[id] == h) &&
+             equal(words, words + words_per_state, arena.begin() + (size_t)id * words_per_state)))
+            return slot;
+    }
+}
+
+void PR2StateRegistry::grow() {
+    // Re-seat every id using the cached hashes
+    vector<int> old_table(table.size() * 2, -1);
+    table.swap(old_table);
+    size_t mask = table.size() - 1;
+    for (int id : old_table) {
+        if (-1 == id)
+            continue;
+        size_t slot = hashes[id] & mask;
+        while (-1 != table[slot])
+            slot = (slot + 1) & mask;
+        table[slot] = id;
+    }
+}
 
-// TODO: Confirm that we no longer need a hash on PR2States
-// size_t PR2State::hash() const {
-//     // TODO: Cache this
-//     utils::HashState hash_state;
-//     utils::feed(hash_state, vars);
-//     return hash_state.get_hash32();
-// }
+int PR2StateRegistry::find(const PR2State &state) const {
+    return table[find_slot(state, state.hash())];
+}
+
+int PR2StateRegistry::insert(const PR2State &state) {
+    assert((int)state.get_packed_words().size() == words_per_state);
+
+    size_t h = state.hash();
+    int slot = find_slot(state, h);
+    if (-1 != table[slot])
+        return table[slot];
+
+    int id = hashes.size();
+    hashes.push_back(h);
+    arena.insert(arena.end(), state.get_packed_words().begin(), state.get_packed_words().end());
+    table[slot] = id;
+
+    // Keep the load factor under a half so probes stay short
+    if (2 * hashes.size() > table.size())
+        grow();
+
+    return id;
+}
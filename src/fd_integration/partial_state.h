@@ -1,6 +1,7 @@
 #ifndef PARTIAL_STATE_H
 #define PARTIAL_STATE_H
 
+#include <cstdint>
 #include <iostream>
 #include <fstream>
 #include <vector>
@@ -9,21 +10,96 @@
 
 #include "../../task_proxy.h"
 
+#include "action_model.h"
+
 class PR2OperatorProxy;
 class StateInterface;
 
+/*******************************************************************
+ * Bit layout shared by every PR2State. Each variable is given a
+ * field that is just wide enough for its domain, and fields never
+ * straddle a 64-bit word. A state holds two parallel word arrays
+ * with this layout: the values, and a mask with the whole field set
+ * for every defined variable (value bits are kept at 0 when the
+ * variable is undefined). This lets entails / consistent_with /
+ * combine_with work a word at a time.
+ *******************************************************************/
+class PR2StatePacker {
+    struct VarInfo {
+        int word; // Index of the word that holds the field
+        int shift; // Position of the field's lowest bit
+        uint64_t mask; // The field's bits (already shifted)
+    };
+
+    std::vector<VarInfo> var_info;
+    std::vector<uint64_t> field_lsb; // Lowest bit of every field, per word (used for counting)
+    int num_words = 0;
+
+public:
+    void initialize(const std::vector<int> &domain_sizes);
+    bool is_initialized() const { return !var_info.empty(); }
+
+    int get_num_vars() const { return var_info.size(); }
+    int get_num_words() const { return num_words; }
+    uint64_t get_field_lsb(int word) const { return field_lsb[word]; }
+
+    int get(const uint64_t *values, const uint64_t *defined, int var) const {
+        const VarInfo &info = var_info[var];
+        if (!(defined[info.word] & info.mask))
+            return -1;
+        return int((values[info.word] & info.mask) >> info.shift);
+    }
+
+    void set(uint64_t *values, uint64_t *defined, int var, int val) const {
+        const VarInfo &info = var_info[var];
+        values[info.word] &= ~info.mask;
+        if (-1 == val) {
+            defined[info.word] &= ~info.mask;
+        } else {
+            values[info.word] |= (uint64_t(val) << info.shift) & info.mask;
+            defined[info.word] |= info.mask;
+        }
+    }
+};
+
 class PR2State : public StateInterface {
-    std::vector<int> vars; // values for vars
+    // Packed words: the first half holds the values and the second half
+    //  holds the defined-mask (see PR2StatePacker).
+    std::vector<uint64_t> words;
+    mutable std::vector<int> unpacked_values; // Only filled when FD asks for the full vector
     std::vector< std::pair<int,int> > * _varvals = NULL; // varval pairs for partial states
-    // void _allocate();
-    // void _deallocate();
-    // void _copy_buffer_from_state(const PR2State &state);
+
+    uint64_t *values() { return words.data(); }
+    const uint64_t *values() const { return words.data(); }
+    uint64_t *defined() { return words.data() + (words.size() / 2); }
+    const uint64_t *defined() const { return words.data() + (words.size() / 2); }
+    int num_words() const { return words.size() / 2; }
+
+    int get(int var) const;
+    void set(int var, int val);
 
 public:
 
-    void unpack() const {};
+    // Lets `state[var] = val` keep working on the packed representation
+    class ValueReference {
+        PR2State &state;
+        int var;
+    public:
+        ValueReference(PR2State &s, int v) : state(s), var(v) {}
+        operator int() const { return state.get(var); }
+        ValueReference &operator=(int val) {
+            state.set(var, val);
+            return *this;
+        }
+        ValueReference &operator=(const ValueReference &other) {
+            return (*this = int(other));
+        }
+    };
+
+    void unpack() const;
     const std::vector<int> &get_unpacked_values() const {
-        return vars;
+        unpack();
+        return unpacked_values;
     };
 
     PR2State &operator=(const PR2State &other);
@@ -34,35 +110,39 @@ public:
     PR2State(const State &state);
     ~PR2State();
 
+#ifndef NDEBUG
+    // Debug self-check of the packed layout (run once it is set up)
+    static void check_packing(const std::vector<int> &domain_sizes);
+#endif
+
     bool is_undefined(VariableProxy var) const {
         return is_undefined(var.get_id());
     }
 
     bool is_undefined(int var) const {
-        return vars[var] == -1;
+        return -1 == get(var);
     }
 
     int size() const;
 
     PR2State * progress(const PR2OperatorProxy &op);
+    PR2State * progress(int op_id);
+    void progress(int op_id, PR2State &next) const; // Writes the successor into next (reusing its storage)
     PR2State * regress(const PR2OperatorProxy &op, PR2State *context=NULL);
 
-    bool triggers(const EffectProxy &effect);
-    bool consistent_with(const PR2State &other);
-    bool entails(const PR2State &other);
+    bool triggers(const PR2ActionModel::Effect &effect) const;
+    bool consistent_with(const PR2State &other) const;
+    bool entails(const PR2State &other) const;
     void combine_with(const PR2State &state);
     std::vector< std::pair<int,int> > * varvals();
 
-    int &operator[](int index) {
-        // Reset varvals cache
-        if (_varvals) {
-            delete _varvals;
-            _varvals = NULL;
-        }
-        return vars[index];
+    // Reading through the reference leaves the varvals cache alone, it is
+    //  only reset when a value is assigned (see set)
+    ValueReference operator[](int index) {
+        return ValueReference(*this, index);
     }
     int operator[](int index) const {
-        return vars[index];
+        return get(index);
     }
 
     void dump_pddl() const;
@@ -71,10 +151,38 @@ public:
     bool operator==(const PR2State &other) const;
     bool operator<(const PR2State &other) const;
 
-    // size_t hash() const;
+    size_t hash() const;
+    const std::vector<uint64_t> &get_packed_words() const { return words; }
 
     void record_snapshot(std::ofstream &outfile, std::string indent);
 
 };
 
+/*******************************************************************
+ * Interns full states: every distinct state is stored once in a
+ * contiguous arena of packed words and given a stable integer id.
+ * Lookups go through a single open-addressing table with the hash
+ * of every entry cached, so a duplicate check costs O(1) instead of
+ * a log N series of vector comparisons.
+ *******************************************************************/
+class PR2StateRegistry {
+    std::vector<uint64_t> arena; // Packed words for every interned state, back to back
+    std::vector<size_t> hashes; // Cached hash for every state id
+    std::vector<int> table; // Open-addressing table of state ids (-1 is empty)
+    int words_per_state;
+
+    int find_slot(const PR2State &state, size_t h) const;
+    void grow();
+
+public:
+    PR2StateRegistry();
+
+    // Returns the id of the state, or -1 if it hasn't been interned
+    int find(const PR2State &state) const;
+    // Interns the state (if need be) and returns its id
+    int insert(const PR2State &state);
+
+    int size() const { return hashes.size(); }
+};
+
 #endif
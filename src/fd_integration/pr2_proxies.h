@@ -191,7 +191,7 @@ public:
 class PR2TaskProxy : public TaskProxy {
 
     // Map from operator id to nondet index
-    vector<int>* nondet_index_map;
+    const vector<int>* nondet_index_map;
 
     const AbstractTask *task;
     PR2State *orig_initial_state;
@@ -213,7 +213,7 @@ public:
         return new PR2GoalProxy(*task);
     }
 
-    void set_nondet_index_map(vector<int> &nmap) {
+    void set_nondet_index_map(const vector<int> &nmap) {
         nondet_index_map = &nmap;
     }
     int get_nondet_index(int op_id) const {
@@ -239,6 +239,10 @@ public:
         return new PR2State(*orig_initial_state);
     }
 
+    const PR2State & get_orig_initial_state() const {
+        return *orig_initial_state;
+    }
+
     string get_fact_name(int var, int val) const {
         return task->get_fact_name(FactPair(var, val));
     }
@@ -3,9 +3,16 @@
 #include "../../plugins/options.h"
 #include "../../plugins/plugin.h"
 
+#include "../../heuristics/goal_count_heuristic.h"
 #include "../../search_algorithms/search_common.h"
 #include "../../search_algorithms/lazy_search.h"
 
+#include "../../evaluation_context.h"
+#include "../../open_list.h"
+#include "../../search_space.h"
+#include "../../state_registry.h"
+#include "../../task_utils/task_properties.h"
+
 #include "../../open_list_factory.h"
 #include "../../operator_cost.h"
 #include "../../utils/memory.h"
@@ -15,9 +22,12 @@
 #include "weak_planning_task.h"
 #include "fsap_penalized_ff_heuristic.h"
 #include "../deadend.h"
+#include "../solution.h"
 
 #include <iostream>
 #include <limits>
+#include <optional>
+#include <set>
 
 using namespace std;
 using namespace utils;
@@ -25,18 +35,179 @@ using namespace utils;
 
 namespace pr2_search {
 
-unique_ptr<SearchAlgorithm> PR2Search::get_search_engine() {
+const char * weak_planner_config_name(int config) {
+    switch (config) {
+        case LAZY_GBFS_PREFERRED: return "lazy-gbfs";
+        case LAZY_GBFS_PLAIN: return "lazy-gbfs-no-pref";
+        case LAZY_GBFS_RANDOMIZED: return "lazy-gbfs-random";
+        case LAZY_GBFS_GOAL_COUNT: return "lazy-gbfs-gc";
+        case LAZY_GBFS_ALTERNATING: return "lazy-gbfs-ff-gc";
+        case EAGER_GBFS_PREFERRED: return "eager-gbfs";
+        default: return "unknown";
+    }
+}
+
+/*******************************************************************
+ * Greedy best-first search with eager evaluation, the same as FD's
+ * eager_greedy, but on the weak task and with the FSAP-aware
+ * successor generator (FD's eager search only runs on the root task
+ * and uses FD's own successor generator). Duplicates are never
+ * reopened, since the plan only needs to be weak.
+ *******************************************************************/
+class EagerWeakSearch : public SearchAlgorithm {
+
+    TaskProxy weak_task_proxy;
+    StateRegistry weak_registry;
+    SearchSpace weak_space;
+
+    unique_ptr<StateOpenList> open_list;
+    vector<shared_ptr<Evaluator>> preferred_operator_evaluators;
+    unique_ptr<DeadendAwareSuccessorGenerator> generator;
+
+protected:
+    virtual void initialize() override {
+        State initial_state = weak_registry.get_initial_state();
+        EvaluationContext eval_context(initial_state, 0, true, &statistics);
+        statistics.inc_evaluated_states();
+        if (open_list->is_dead_end(eval_context))
+            return;
+        weak_space.get_node(initial_state).open_initial();
+        open_list->insert(eval_context, initial_state.get_id());
+    }
+
+    virtual SearchStatus step() override {
+
+        optional<SearchNode> node;
+        while (true) {
+            if (open_list->empty())
+                return FAILED;
+            State s = weak_registry.lookup_state(open_list->remove_min());
+            node.emplace(weak_space.get_node(s));
+            if (!node->is_closed())
+                break;
+        }
+
+        const State &s = node->get_state();
+        if (task_properties::is_goal_state(weak_task_proxy, s)) {
+            Plan plan;
+            weak_space.trace_path(s, plan);
+            set_plan(plan);
+            return SOLVED;
+        }
+
+        node->close();
+        statistics.inc_expanded();
+
+        vector<OperatorID> ops;
+        generator->generate_applicable_ops(PR2State(s), ops);
+
+        set<OperatorID> preferred_ops;
+        EvaluationContext eval_context(s, node->get_g(), false, &statistics, true);
+        for (const shared_ptr<Evaluator> &evaluator : preferred_operator_evaluators)
+            for (OperatorID op_id : eval_context.get_preferred_operators(evaluator.get()))
+                preferred_ops.insert(op_id);
+
+        for (OperatorID op_id : ops) {
+
+            OperatorProxy op = weak_task_proxy.get_operators()[op_id];
+            State succ = weak_registry.get_successor_state(s, op);
+            statistics.inc_generated();
+
+            SearchNode succ_node = weak_space.get_node(succ);
+            if (!succ_node.is_new())
+                continue;
+
+            int succ_g = node->get_g() + get_adjusted_cost(op);
+            EvaluationContext succ_context(succ, succ_g, preferred_ops.count(op_id) > 0, &statistics);
+            statistics.inc_evaluated_states();
+
+            if (open_list->is_dead_end(succ_context)) {
+                succ_node.mark_as_dead_end();
+                statistics.inc_dead_ends();
+                continue;
+            }
+
+            succ_node.open_new_node(*node, op, get_adjusted_cost(op));
+            open_list->insert(succ_context, succ.get_id());
+        }
+
+        return IN_PROGRESS;
+    }
+
+public:
+    EagerWeakSearch(const shared_ptr<OpenListFactory> &open,
+                    const vector<shared_ptr<Evaluator>> &preferred,
+                    const shared_ptr<AbstractTask> &task,
+                    DeadendAwareSuccessorGenerator *generator)
+        : SearchAlgorithm(ONE, numeric_limits<int>::max(), numeric_limits<double>::infinity(),
+                          "PR2 Eager Search", utils::Verbosity::SILENT),
+          weak_task_proxy(*task),
+          weak_registry(weak_task_proxy),
+          weak_space(weak_registry, log),
+          open_list(open->create_state_open_list()),
+          preferred_operator_evaluators(preferred),
+          generator(generator) {}
+
+    virtual void print_statistics() const override {
+        statistics.print_detailed_statistics();
+    }
+};
+
+// Wraps one of the searches above so it can be stepped from outside, and
+//  so it gives up as soon as it has used up its expansion budget (each
+//  step expands at most one state)
+template <class Search>
+class BudgetedSearch : public Search, public WeakSearch {
+
+    const DeadendAwareSuccessorGenerator *generator;
+    int portfolio_budget;
+
+public:
+    template <class... Args>
+    BudgetedSearch(const DeadendAwareSuccessorGenerator *generator, int portfolio_budget, Args &&... args)
+        : Search(std::forward<Args>(args)...),
+          generator(generator),
+          portfolio_budget(portfolio_budget) {}
+
+    virtual void start() override { this->initialize(); }
+    virtual SearchStatus advance() override { return step(); }
+    virtual const Plan &get_plan() const override { return Search::get_plan(); }
+
+protected:
+    virtual SearchStatus step() override {
+        bool portfolio_cap;
+        if (weak_search_budget_spent(generator->expansions, portfolio_budget, &portfolio_cap)) {
+            if (portfolio_cap)
+                PR2().weaksearch.portfolio_budget_hits++;
+            else
+                PR2().weaksearch.capped_searches++;
+            return FAILED;
+        }
+        return Search::step();
+    }
+};
+
+unique_ptr<WeakSearch> PR2Search::create_weak_search(int config, int portfolio_budget) {
     /*
       Build the same search engine that would be generated by the
-      command-line option "lazy_greedy(ff())". This is a bit complex
+      command-line option "lazy_greedy(ff())" (or one of its variants,
+      depending on the configuration). This is a bit complex
       because we need to manually set options that have default values
       when used from the command line and because "lazy_greedy" is a
       factory function with somewhat complex behaviour.
     */
 
-    auto initial_state_values = PR2.proxy->get_pr2_initial_state()->get_unpacked_values();
-    auto goals = PR2.proxy->get_pr2_goals();
-    std::shared_ptr<extra_tasks::WeakPlanningTask> weak_task = std::make_shared<extra_tasks::WeakPlanningTask>(tasks::g_root_task, std::move(initial_state_values), std::move(*goals));
+    const vector<int> &initial_state_values = PR2().proxy->get_pr2_initial_state()->get_unpacked_values();
+    auto goals = PR2().proxy->get_pr2_goals();
+
+    // The weak tasks are only built once, and then reset in place
+    if (weak_tasks.empty())
+        weak_tasks.resize(NUM_WEAK_PLANNER_CONFIGS);
+    shared_ptr<extra_tasks::WeakPlanningTask> &weak_task = weak_tasks[config];
+    if (weak_task)
+        weak_task->reset(initial_state_values, *goals);
+    else
+        weak_task = std::make_shared<extra_tasks::WeakPlanningTask>(tasks::g_root_task, vector<int>(initial_state_values), vector<FactPair>(*goals));
 
     // Build FF heuristic object.
     if (h) {
@@ -47,20 +218,47 @@ unique_ptr<SearchAlgorithm> PR2Search::get_search_engine() {
         preferred_list_scalar.push_back(h);
     }
 
-    // Build open list object.
-    shared_ptr<OpenListFactory> open_list = search_common::create_greedy_open_list_factory(
-        preferred_list_scalar,
-        preferred_list,
-        500
-    );
+    bool use_preferred = (config != LAZY_GBFS_PLAIN) && (config != LAZY_GBFS_GOAL_COUNT);
+    vector<std::shared_ptr<Evaluator>> no_preferred;
+
+    vector<std::shared_ptr<Evaluator>> evals = preferred_list_scalar;
+    if ((config == LAZY_GBFS_GOAL_COUNT) || (config == LAZY_GBFS_ALTERNATING)) {
+        if (goal_counts.empty())
+            goal_counts.resize(NUM_WEAK_PLANNER_CONFIGS);
+        if (!goal_counts[config])
+            goal_counts[config] = make_shared<goal_count_heuristic::GoalCountHeuristic>(weak_task, true, "Goal Count", utils::Verbosity::SILENT);
+        if (config == LAZY_GBFS_GOAL_COUNT)
+            evals.clear();
+        evals.push_back(goal_counts[config]);
+    }
 
-    // Build lazy search object.
-    lazy_search::LazySearch *engine = new lazy_search::LazySearch(
-        open_list,
+    // Build open list object (the evaluators never change).
+    if (open_lists.empty())
+        open_lists.resize(NUM_WEAK_PLANNER_CONFIGS);
+    if (!open_lists[config])
+        open_lists[config] = search_common::create_greedy_open_list_factory(
+            evals,
+            use_preferred ? preferred_list : no_preferred,
+            use_preferred ? 500 : 0
+        );
+
+    DeadendAwareSuccessorGenerator *generator = new DeadendAwareSuccessorGenerator(true, weak_task.get());
+
+    if (config == EAGER_GBFS_PREFERRED)
+        return make_unique<BudgetedSearch<EagerWeakSearch>>(
+            generator, portfolio_budget,
+            open_lists[config], preferred_list, weak_task, generator);
+
+    // Build lazy search object. This is the part that isn't reused: its
+    //  StateRegistry and SearchSpace are members of FD's SearchAlgorithm
+    //  and can't be reset for a new initial state.
+    return make_unique<BudgetedSearch<lazy_search::LazySearch>>(
+        generator, portfolio_budget,
+        open_lists[config],
         false,
-        preferred_list_scalar,
-        false,
-        true,
+        use_preferred ? preferred_list_scalar : no_preferred,
+        (config == LAZY_GBFS_RANDOMIZED),
+        use_preferred,
         -1,
         ONE,
         numeric_limits<int>::max(),
@@ -68,9 +266,7 @@ unique_ptr<SearchAlgorithm> PR2Search::get_search_engine() {
         "PR2 Search",
         utils::Verbosity::SILENT,
         weak_task,
-        new DeadendAwareSuccessorGenerator());
-
-    return unique_ptr<SearchAlgorithm>(engine);
+        generator);
 }
 
 PR2Search::PR2Search(const plugins::Options &opts)
@@ -79,13 +275,57 @@ PR2Search::PR2Search(const plugins::Options &opts)
 
 SearchStatus PR2Search::step() {
 
-    unique_ptr<SearchAlgorithm> current_search = get_search_engine();
-    current_search->search();
+    unique_ptr<WeakSearch> current_search = create_weak_search(config, -1);
+    current_search->start();
 
-    if (current_search->found_solution())
+    SearchStatus status = current_search->advance();
+    while (IN_PROGRESS == status)
+        status = current_search->advance();
+
+    if (SOLVED == status)
         set_plan(current_search->get_plan());
 
-    return current_search->get_status();
+    return status;
+}
+
+int PR2Search::race(const vector<int> &configs, int portfolio_budget, const function<bool(const Plan &)> &accept) {
+
+    // The searches share the FD and PR2 state that isn't thread safe (FD's
+    //  per-task caches, the forbidden ops cache, the deadend policy that
+    //  online combination updates), so rather than running on separate
+    //  threads, they are interleaved one step at a time
+    vector<unique_ptr<WeakSearch>> searches;
+    for (int c : configs) {
+        searches.push_back(create_weak_search(c, portfolio_budget));
+        searches.back()->start();
+    }
+
+    size_t running = searches.size();
+    while (running > 0) {
+        for (size_t i = 0; i < searches.size(); i++) {
+
+            if (!searches[i])
+                continue;
+
+            SearchStatus status = searches[i]->advance();
+            if (IN_PROGRESS == status)
+                continue;
+
+            PR2().weaksearch.num_searches++;
+            if ((SOLVED == status) && accept(searches[i]->get_plan())) {
+                // The rest are cancelled (and counted) as they are dropped
+                for (size_t j = 0; j < searches.size(); j++)
+                    if ((j != i) && searches[j])
+                        PR2().weaksearch.num_searches++;
+                return configs[i];
+            }
+
+            searches[i].reset();
+            running--;
+        }
+    }
+
+    return -1;
 }
 
 void PR2Search::print_statistics() const {
@@ -120,71 +360,156 @@ void PR2Search::save_plan_if_necessary() { }
 
 
 
-void DeadendAwareSuccessorGenerator::generate_applicable_ops(const PR2State &_curr, vector<OperatorID> &ops) const {
-    if (PR2.deadend.enabled && PR2.deadend.policy) {
+bool weak_search_budget_spent(int expansions, int portfolio_budget, bool *portfolio_cap) {
+    int budget = PR2().weaksearch.limit_states ? PR2().weaksearch.max_states : -1;
+    bool from_portfolio = false;
+    if ((portfolio_budget >= 0) && ((-1 == budget) || (portfolio_budget < budget))) {
+        budget = portfolio_budget;
+        from_portfolio = true;
+    }
+    if (portfolio_cap)
+        *portfolio_cap = from_portfolio;
+    return (-1 != budget) && (expansions >= budget);
+}
+
+void DeadendAwareSuccessorGenerator::generate_applicable_ops(const PR2State &curr, vector<OperatorID> &ops) const {
+
+    // The budget itself is enforced by BudgetedSearch::step
+    if (limit_expansions)
+        expansions++;
+
+    size_t first_op = ops.size();
+    generate_unforbidden_ops(curr, ops);
 
-        PR2State curr = PR2State(_curr);
+    if (weak_task && PR2().weaksearch.stop_on_policy && !goal_on_policy && PR2().solution.incumbent)
+        stop_at_policy(curr, ops, first_op);
+}
 
-        vector<PolicyItem *> reg_items;
-        vector<OperatorID> orig_ops;
-        map<int, PolicyItem *> fsap_map;
+// Moves the weak search's goal to the first successor that the goal step
+//  or a strong cyclic step of the incumbent handles, so the search ends
+//  when it pops that state rather than carrying on to the actual goal.
+//  The goal only moves once per search: the successor hasn't been
+//  generated before (it would have moved the goal then), so it is sure
+//  to be popped and goal-tested.
+void DeadendAwareSuccessorGenerator::stop_at_policy(const PR2State &curr, const vector<OperatorID> &ops, size_t first_op) const {
+
+    PR2State next(curr);
+    for (size_t i = first_op; i < ops.size(); i++) {
+
+        curr.progress(ops[i].get_index(), next);
+        SolutionStep *step = PR2().solution.incumbent->get_step(next);
+        if (!step || !(step->is_goal || step->is_sc))
+            continue;
+
+        const PR2State &cond = *(step->state);
+        vector<FactPair> goals;
+        for (unsigned var = 0; var < PR2().task->num_vars; var++)
+            if (!cond.is_undefined(var))
+                goals.push_back(FactPair(var, cond[var]));
+
+        weak_task->set_goals(goals);
+        goal_on_policy = true;
+        PR2().weaksearch.policy_goals++;
+        return;
+    }
+}
 
-        PR2.generate_orig_applicable_ops(_curr, orig_ops);
-        PR2.deadend.policy->generate_entailed_items(curr, reg_items);
+void DeadendAwareSuccessorGenerator::generate_unforbidden_ops(const PR2State &curr, vector<OperatorID> &ops) const {
 
-        set<int> forbidden;
-        for (auto item : reg_items) {
+    if (PR2().deadend.enabled && PR2().deadend.policy) {
 
-            int index = ((FSAP*)item)->get_index();
+        if (!PR2().deadend.forbidden_ops_cache)
+            PR2().deadend.forbidden_ops_cache = make_unique<ForbiddenOpsCache>();
+        ForbiddenOpsCache &cache = *(PR2().deadend.forbidden_ops_cache);
 
-            forbidden.insert(index);
+        int version = PR2().deadend.fsap_version;
+        ForbiddenOpsCacheEntry &entry = cache.entries[curr.hash() & (FORBIDDEN_OPS_CACHE_SIZE - 1)];
+        if ((entry.version == version) && (entry.words == curr.get_packed_words())) {
+            ops.insert(ops.end(), entry.ops.begin(), entry.ops.end());
+            return;
+        }
 
-            if ((fsap_map.find(index) == fsap_map.end()) ||
-                (item->state->size() < fsap_map[index]->state->size()))
-                    fsap_map[index] = item;
+        ForbiddenOpsScratch &scratch = cache.scratch;
+        if (scratch.smallest_fsap.size() < PR2().deadend.nondetop2fsaps.size()) {
+            scratch.forbidden.assign((PR2().deadend.nondetop2fsaps.size() + 63) / 64, 0);
+            scratch.smallest_fsap.assign(PR2().deadend.nondetop2fsaps.size(), nullptr);
         }
 
+        vector<OperatorID> &orig_ops = scratch.orig_ops;
+        orig_ops.clear();
+        PR2().generate_orig_applicable_ops(curr, orig_ops);
+
+        PR2().deadend.policy->visit_entailed_items<FSAP>(curr, [&scratch](FSAP *item) {
+
+            int index = item->get_index();
+
+            if (!scratch.is_forbidden(index)) {
+                scratch.forbidden[index >> 6] |= uint64_t(1) << (index & 63);
+                scratch.touched.push_back(index);
+            }
+
+            if (!scratch.smallest_fsap[index] ||
+                (item->state->size() < scratch.smallest_fsap[index]->state->size()))
+                    scratch.smallest_fsap[index] = item;
+
+            return true;
+        });
+
+        size_t first_op = ops.size();
         vector<int> ruled_out;
         for (auto opid : orig_ops) {
-            if (0 == forbidden.count(PR2.proxy->get_nondet_index(opid)))
+            if (!scratch.is_forbidden(PR2().proxy->get_nondet_index(opid)))
                 ops.push_back(opid);
-            else if (PR2.deadend.combine)
-                ruled_out.push_back(PR2.proxy->get_nondet_index(opid));
+            else if (PR2().deadend.combine)
+                ruled_out.push_back(PR2().proxy->get_nondet_index(opid));
         }
 
         // Add this state as a deadend if we have ruled out everything
-        if (!PR2.weaksearch.limit_states && PR2.deadend.record_online &&
-             PR2.deadend.combine && (orig_ops.size() > 0) && ops.empty()) {
+        if (!PR2().weaksearch.limit_states && PR2().deadend.record_online &&
+             PR2().deadend.combine && (orig_ops.size() > 0) && (ops.size() == first_op)) {
+
+            PR2State context = PR2State(curr);
 
             // Combind all of the FSAPs
             PR2State *newDE = new PR2State();
             for (unsigned i = 0; i < ruled_out.size(); i++) {
-                newDE->combine_with(*(((FSAP*)(fsap_map[ruled_out[i]]))->state));
+                newDE->combine_with(*(scratch.smallest_fsap[ruled_out[i]]->state));
             }
 
             // Also rule out all of the unapplicable actions
-            for (const auto & op : PR2.proxy->get_operators()) {
-                if (0 == forbidden.count(op.nondet_index)) {
+            for (const auto & op : PR2().proxy->get_operators()) {
+                if (!scratch.is_forbidden(op.nondet_index)) {
                     if (op.is_possibly_applicable(*newDE)) {
-                        assert (!(op.is_possibly_applicable(curr)));
-                        int conflict_var = op.compute_conflict_var(curr);
+                        assert (!(op.is_possibly_applicable(context)));
+                        int conflict_var = op.compute_conflict_var(context);
                         assert (conflict_var != -1);
                         assert ((*newDE)[conflict_var] == -1);
-                        (*newDE)[conflict_var] = curr[conflict_var];
+                        (*newDE)[conflict_var] = context[conflict_var];
                     }
                 }
             }
 
-            PR2.deadend.combination_count++;
+            PR2().deadend.combination_count++;
+
+            // Updating the deadends changes the FSAP version, so the
+            //  result isn't cached
+            scratch.reset();
 
             vector<DeadendTuple *> failed_states;
             failed_states.push_back(new DeadendTuple(newDE, NULL, NULL));
             update_deadends(failed_states);
+            return;
         }
 
+        scratch.reset();
+
+        entry.version = version;
+        entry.words = curr.get_packed_words();
+        entry.ops.assign(ops.begin() + first_op, ops.end());
+
     } else {
 
-        PR2.generate_orig_applicable_ops(_curr, ops);
+        PR2().generate_orig_applicable_ops(curr, ops);
 
     }
 
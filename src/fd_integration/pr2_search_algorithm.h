@@ -19,6 +19,15 @@ namespace successor_generator {
     class SuccessorGenerator;
 }
 
+namespace extra_tasks {
+    class WeakPlanningTask;
+}
+
+class OpenListFactory;
+struct FSAP;
+
+#include <cstdint>
+#include <functional>
 #include <memory>
 
 namespace plugins {
@@ -26,10 +35,96 @@ class Options;
 }
 
 struct DeadendAwareSuccessorGenerator {
+    bool limit_expansions; // Set for the weak search, which calls this once per expansion
+    extra_tasks::WeakPlanningTask *weak_task; // Task the weak search runs on (its goal moves with stop_on_policy)
+
+    mutable int expansions = 0; // States the weak search has expanded so far
+    mutable bool goal_on_policy = false; // Set once the weak task's goal has moved to a state the policy handles
+
+    DeadendAwareSuccessorGenerator(bool limit = false, extra_tasks::WeakPlanningTask *task = nullptr)
+        : limit_expansions(limit), weak_task(task) {}
+
     void generate_applicable_ops(const PR2State &curr, vector<OperatorID> &ops) const;
+
+private:
+    void generate_unforbidden_ops(const PR2State &curr, vector<OperatorID> &ops) const;
+    void stop_at_policy(const PR2State &curr, const vector<OperatorID> &ops, size_t first_op) const;
+};
+
+// True once a weak search has used up its expansion budget (max_states
+//  with limit_states, or portfolio_budget if that is set and smaller).
+//  portfolio_cap says which of the two it is.
+bool weak_search_budget_spent(int expansions, int portfolio_budget, bool *portfolio_cap = nullptr);
+
+/*******************************************************************
+ * Scratch space and cache for the deadend aware successor generator,
+ * kept in the planner context so every instance (the weak search
+ * creates its own) shares them. The cache is direct-mapped on the
+ * state hash and remembers the final list of ops for a state, tagged
+ * with the FSAP version it was computed under, so repeated expansions
+ * skip the FSAP query.
+ *******************************************************************/
+struct ForbiddenOpsScratch {
+    vector<OperatorID> orig_ops;
+    vector<uint64_t> forbidden; // Bitset of forbidden nondet indices
+    vector<FSAP *> smallest_fsap; // Most general FSAP for each forbidden nondet index
+    vector<int> touched; // Forbidden nondet indices (used to reset the above)
+
+    bool is_forbidden(int index) const { return forbidden[index >> 6] & (uint64_t(1) << (index & 63)); }
+
+    void reset() {
+        for (int index : touched) {
+            forbidden[index >> 6] = 0;
+            smallest_fsap[index] = nullptr;
+        }
+        touched.clear();
+    }
+};
+
+struct ForbiddenOpsCacheEntry {
+    int version = -1; // PR2().deadend.fsap_version when the entry was filled (-1 if empty)
+    vector<uint64_t> words; // Packed state
+    vector<OperatorID> ops;
+};
+
+static const size_t FORBIDDEN_OPS_CACHE_SIZE = 1024; // Must be a power of 2
+
+struct ForbiddenOpsCache {
+    ForbiddenOpsScratch scratch;
+    vector<ForbiddenOpsCacheEntry> entries = vector<ForbiddenOpsCacheEntry>(FORBIDDEN_OPS_CACHE_SIZE);
 };
 
 namespace pr2_search {
+
+// The weak planner configurations that PR2Search can run (see
+//  create_weak_search). The heuristic is free to change, as forbidden
+//  operators are pruned by the successor generator either way. FD's
+//  lazy search takes that generator directly; its eager search only
+//  runs on the root task, so the eager configuration uses PR2's own
+//  EagerWeakSearch instead.
+enum WeakPlannerConfig {
+    LAZY_GBFS_PREFERRED, // lazy_greedy(ff()) with preferred operators (the default)
+    LAZY_GBFS_PLAIN, // lazy_greedy(ff()) without preferred operators
+    LAZY_GBFS_RANDOMIZED, // LAZY_GBFS_PREFERRED with the successors shuffled
+    LAZY_GBFS_GOAL_COUNT, // lazy_greedy(goalcount())
+    LAZY_GBFS_ALTERNATING, // lazy_greedy([ff(), goalcount()], preferred=[ff()])
+    EAGER_GBFS_PREFERRED, // eager_greedy([ff()], preferred=[ff()])
+    NUM_WEAK_PLANNER_CONFIGS
+};
+
+const char * weak_planner_config_name(int config);
+
+// A weak search that can be run one step (at most one expansion) at a
+//  time, so that several of them can be raced against each other
+class WeakSearch {
+public:
+    virtual ~WeakSearch() = default;
+
+    virtual void start() = 0;
+    virtual SearchStatus advance() = 0;
+    virtual const Plan &get_plan() const = 0;
+};
+
 class PR2Search : public SearchAlgorithm {
 
     // The heuristic we want to use. If there is ever more than one option,
@@ -40,7 +135,24 @@ class PR2Search : public SearchAlgorithm {
     vector<std::shared_ptr<Evaluator>> preferred_list;
     vector<std::shared_ptr<Evaluator>> preferred_list_scalar;
 
-    std::unique_ptr<SearchAlgorithm> get_search_engine();
+    // Kept across weak searches, so FD's per-task data (e.g., the
+    //  successor generator) is only computed once for each weak task.
+    //  The search built on top of them (and with it the state registry
+    //  and search space) is still new for every weak search, as FD has
+    //  no way to clear those in place. Every configuration has its own
+    //  weak task, since the goal of a running search can move (see
+    //  DeadendAwareSuccessorGenerator::stop_at_policy).
+    vector<std::shared_ptr<extra_tasks::WeakPlanningTask>> weak_tasks; // One per configuration
+    vector<std::shared_ptr<OpenListFactory>> open_lists; // One per configuration
+
+    // Goal count heuristics for the alternative configurations. They are
+    //  built on the configuration's weak task, and read the goal from it
+    //  every time.
+    vector<std::shared_ptr<Evaluator>> goal_counts; // One per configuration
+
+    int config = LAZY_GBFS_PREFERRED;
+
+    std::unique_ptr<WeakSearch> create_weak_search(int config, int portfolio_budget);
     virtual SearchStatus step() override;
 
     DeadendAwareSuccessorGenerator deadend_aware_successor_generator;
@@ -56,6 +168,14 @@ public:
         return &deadend_aware_successor_generator;
     };
 
+    void set_config(int c) { config = c; }
+
+    // Races the given configurations, with at most portfolio_budget
+    //  expansions each. They take a step in turn, and the first plan that
+    //  accept takes wins, at which point the other searches are dropped.
+    //  Returns the winning configuration (-1 if none).
+    int race(const vector<int> &configs, int portfolio_budget, const std::function<bool(const Plan &)> &accept);
+
     virtual void save_plan_if_necessary() override;
     virtual void print_statistics() const override;
 
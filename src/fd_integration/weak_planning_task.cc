@@ -12,6 +12,15 @@ WeakPlanningTask::WeakPlanningTask(
       goals(move(goals)) {
 }
 
+void WeakPlanningTask::reset(const vector<int> &initial_state_values, const vector<FactPair> &goals) {
+    this->initial_state_values.assign(initial_state_values.begin(), initial_state_values.end());
+    this->goals.assign(goals.begin(), goals.end());
+}
+
+void WeakPlanningTask::set_goals(const vector<FactPair> &goals) {
+    this->goals.assign(goals.begin(), goals.end());
+}
+
 int WeakPlanningTask::get_num_goals() const {
     return goals.size();
 }
@@ -7,8 +7,8 @@
 
 namespace extra_tasks {
 class WeakPlanningTask : public tasks::DelegatingTask {
-    const std::vector<int> initial_state_values;
-    const std::vector<FactPair> goals;
+    std::vector<int> initial_state_values;
+    std::vector<FactPair> goals;
 public:
     WeakPlanningTask(
         const std::shared_ptr<AbstractTask> &parent,
@@ -16,6 +16,13 @@ public:
         std::vector<FactPair> &&goals);
     ~WeakPlanningTask() = default;
 
+    // Swaps in a new problem (only valid while no search is using the task)
+    void reset(const std::vector<int> &initial_state_values, const std::vector<FactPair> &goals);
+
+    // Moves the goal while a search is running (the search goal-tests
+    //  against whatever is set when it pops a state)
+    void set_goals(const std::vector<FactPair> &goals);
+
     virtual int get_num_goals() const override;
     virtual FactPair get_goal_fact(int index) const override;
     
@@ -16,17 +16,17 @@
 
 bool find_better_solution(Simulator *sim) {
 
-    PR2.logging.fond_search_count++;
+    PR2().logging.fond_search_count++;
 
     PR2SearchStatus * status;
 
-    cout << "\n\nFOND Search: Round " << PR2.logging.fond_search_count << endl;
+    cout << "\n\nFOND Search: Round " << PR2().logging.fond_search_count << endl;
 
     // Restore the search if we stopped early due to an epoch timeout
-    if (PR2.epoch.last_search_status) {
+    if (PR2().epoch.last_search_status) {
 
         cout << "Restoring the search from a previous epoch..." << endl;
-        status = PR2.epoch.last_search_status;
+        status = PR2().epoch.last_search_status;
         status->warm_start = true;
 
     } else {
@@ -35,18 +35,18 @@ bool find_better_solution(Simulator *sim) {
         status = new PR2SearchStatus(sim);
 
         // For now, we only record the search nodes if we need them in snapshots
-        if (PR2.logging.dump_snapshots)
+        if (PR2().logging.dump_snapshots)
             status->created_search_nodes = new list< PR2SearchNode * >();
 
         // Back up the originial initial state
-        status->old_initial_state = PR2.proxy->generate_new_init();
+        status->old_initial_state = PR2().proxy->generate_new_init();
         // Build the goal state
         status->goal_orig = new PR2State();
-        for (auto goal_pair : PR2.proxy->get_goals())
+        for (auto goal_pair : PR2().proxy->get_goals())
             (*(status->goal_orig))[goal_pair.get_variable().get_id()] = goal_pair.get_value();
 
         status->init();
-        status->current_state = PR2.proxy->generate_new_init();
+        status->current_state = PR2().proxy->generate_new_init();
         status->current_goal = new PR2State(*(status->goal_orig));
 
         PR2SearchNode *init_node = new PR2SearchNode(status->current_state, status->current_goal, NULL, NULL, -1);
@@ -58,12 +58,12 @@ bool find_better_solution(Simulator *sim) {
         status->created_states->push_back(status->current_goal);
     }
 
-    if (!PR2.logging.fond_search)
+    if (!PR2().logging.fond_search)
         cout << "\n {" << flush;
 
     // Keep going while there's still time and until we've closed off
     //  the entire open list or found a strong cyclic incumbent.
-    while (status->keep_searching() && !(PR2.solution.incumbent->is_strong_cyclic())) {
+    while (status->keep_searching() && !(PR2().solution.incumbent->is_strong_cyclic())) {
         // Commonly used snapshot logging code
         status->validate_if_needbe();
         status->snapshot_if_needbe();
@@ -154,14 +154,14 @@ bool find_better_solution(Simulator *sim) {
      *
      ********************************************************************/
 
-    bool time_limit_hit = !PR2.time.time_left();
+    bool time_limit_hit = !PR2().time.time_left();
 
     // Reset the original goal and initial state
     sim->set_state(status->old_initial_state);
     sim->set_goal(status->goal_orig);
 
     // Do a full marking of the psgraph for proper analysis
-    PR2.solution.incumbent->network->full_marking();
+    PR2().solution.incumbent->network->full_marking();
 
     // Commonly used snapshot logging code
     status->validate_if_needbe();
@@ -178,7 +178,7 @@ bool find_better_solution(Simulator *sim) {
 
     // If we don't need to re-run, and we didn't finish early, then the psgraph
     //  must be comlete -- thus the initial state must be strong cyclic.
-    assert(!PR2.deadend.enabled || run_again || PR2.solution.incumbent->is_strong_cyclic());
+    assert(!PR2().deadend.enabled || run_again || PR2().solution.incumbent->is_strong_cyclic());
 
     // Store the rollout in case we want to pick the search up in the
     //  next epoch or final fsap-free round
@@ -198,7 +198,7 @@ bool find_better_solution(Simulator *sim) {
 // Case 1 //
 // See if this node is poisoned, or should be flagged as such //
 bool case1_poisoned_node(PR2SearchStatus * SS) {
-    if (!PR2.deadend.poison_search)
+    if (!PR2().deadend.poison_search)
         return false;
 
     SS->last_round_type = "(case-1) Poisoned node";
@@ -209,7 +209,7 @@ bool case1_poisoned_node(PR2SearchStatus * SS) {
     if (SS->current_node->poisoned)
         poisoned = true;
     // Check if this state is a recognized deadend
-    else if (PR2.deadend.states->check_entailed_match(*(SS->current_state)) ||
+    else if (PR2().deadend.states->check_entailed_match(*(SS->current_state)) ||
              is_deadend(*(SS->current_state))) {
         poisoned = true;
         SS->poisoned = true;
@@ -217,8 +217,8 @@ bool case1_poisoned_node(PR2SearchStatus * SS) {
         SS->mark_current_state_failed();
     }
 
-    if (poisoned && PR2.logging.fond_search) {
-        cout << "\nFONDSEARCH(" << PR2.logging.id() << "): Current node found to be poisoned:" << endl;
+    if (poisoned && PR2().logging.fond_search) {
+        cout << "\nFONDSEARCH(" << PR2().logging.id() << "): Current node found to be poisoned:" << endl;
         SS->current_node->dump();
     }
 
@@ -235,8 +235,8 @@ bool case2_match_complete_state(PR2SearchStatus * SS) {
 
     SS->last_round_type = "(case-2) Matched complete state\\n -- No modification";
 
-    if (PR2.logging.fond_search) {
-        cout << "\nFONDSEARCH(" << PR2.logging.id() << "): Matched on the complete state:" << endl;
+    if (PR2().logging.fond_search) {
+        cout << "\nFONDSEARCH(" << PR2().logging.id() << "): Matched on the complete state:" << endl;
         SS->current_node->dump();
         SS->current_state->dump_pddl();
     }
@@ -248,7 +248,7 @@ bool case2_match_complete_state(PR2SearchStatus * SS) {
 
     // Point the previous node to the original search node for
     //  this state, and add it as a pointer back.
-    PR2SearchNode * original_node = (*(SS->state2searchnode))[*(SS->current_state)];
+    PR2SearchNode * original_node = (*(SS->state2searchnode))[SS->current_state_id];
     assert(original_node);
 
     // If this is truely a duplicate, then we don't need to do anything
@@ -305,8 +305,8 @@ bool case3_predefined_path(PR2SearchStatus * SS) {
 
         SS->last_round_type = "(case-3) Predefined Path";
 
-        if (PR2.logging.fond_search)
-            cout << "\nFONDSEARCH(" << PR2.logging.id() << "): Handled by Case-3 (pre-defined path)" << endl;
+        if (PR2().logging.fond_search)
+            cout << "\nFONDSEARCH(" << PR2().logging.id() << "): Handled by Case-3 (pre-defined path)" << endl;
 
         // We assume that the newly reached state matches the
         //  target solstep, because otherwise there wouldn't be
@@ -331,14 +331,14 @@ bool case3_predefined_path(PR2SearchStatus * SS) {
 bool case4_hookup_solsteps(PR2SearchStatus * SS) {
 
     // See if we can already handle this state by a new hookup in the solution graph
-    SolutionStep * solstep = PR2.solution.incumbent->get_step(*(SS->current_state));
+    SolutionStep * solstep = PR2().solution.incumbent->get_step(*(SS->current_state));
 
     if (solstep) {
 
         SS->last_round_type = "(case-4) Hooking Up";
 
-        if (PR2.logging.fond_search)
-            cout << "\nFONDSEARCH(" << PR2.logging.id() << "): Handled by Case-4 (connecting up solsteps)" << endl;
+        if (PR2().logging.fond_search)
+            cout << "\nFONDSEARCH(" << PR2().logging.id() << "): Handled by Case-4 (connecting up solsteps)" << endl;
 
         // Expand the state given the new solstep connection
         SS->current_node->expand(SS, solstep);
@@ -365,8 +365,8 @@ bool case5_new_path(PR2SearchStatus * SS) {
 
         SS->last_round_type = "(case-5) New Path";
 
-        if (PR2.logging.fond_search)
-            cout << "\nFONDSEARCH(" << PR2.logging.id() << "): Handled by Case-5 (computing new path)" << endl;
+        if (PR2().logging.fond_search)
+            cout << "\nFONDSEARCH(" << PR2().logging.id() << "): Handled by Case-5 (computing new path)" << endl;
 
         // Update the statistics, as we just patched up the
         //  policy a little bit.
@@ -382,7 +382,7 @@ bool case5_new_path(PR2SearchStatus * SS) {
         PR2State * plan_state = SS->current_state;
         SolutionStep * plan_solstep = solstep;
         PR2SearchNode * expected_node = SS->current_node;
-        for (auto op : SS->sim->engine->get_plan()) {
+        for (auto op : SS->sim->get_plan()) {
 
             assert(op.get_index() == plan_solstep->op.get_id());
             assert(plan_state->entails(*(plan_solstep->state)));
@@ -390,20 +390,16 @@ bool case5_new_path(PR2SearchStatus * SS) {
             if (op.get_index() != plan_solstep->op.get_id())
                 cout << "ERROR: op and plan_solstep->op don't match!" << endl;
 
-            if (PR2.logging.fond_search_expanding) {
-                cout << "\nFONDSEARCH-EXPANSION(" << PR2.logging.id() << "): Inserting seen state:" << endl;
+            if (PR2().logging.fond_search_expanding) {
+                cout << "\nFONDSEARCH-EXPANSION(" << PR2().logging.id() << "): Inserting seen state:" << endl;
                 plan_state->dump_pddl();
             }
 
             // If this is a new state that we're expanding and assuming part
             //  of the fond search, then we should add the nodes to the respective
             //  data structures as it would if it was just popped off the queue.
-            if (SS->current_state != plan_state) {
-                assert(0 == SS->seen->count(*plan_state));
-                assert(SS->state2searchnode->find(*plan_state) == SS->state2searchnode->end());
-                SS->seen->insert(*plan_state);
-                (*(SS->state2searchnode))[*plan_state] = expected_node;
-            }
+            if (SS->current_state != plan_state)
+                SS->record_seen_state(plan_state, expected_node);
 
             expected_node = expected_node->expand(SS, plan_solstep);
 
@@ -429,8 +425,8 @@ bool case6_deadend(PR2SearchStatus * SS) {
 
     SS->last_round_type = "(case-6) Node Unhandled";
 
-    if (PR2.logging.fond_search)
-        cout << "\nFONDSEARCH(" << PR2.logging.id() << "): Handled by Case-6 (deadend)" << endl;
+    if (PR2().logging.fond_search)
+        cout << "\nFONDSEARCH(" << PR2().logging.id() << "): Handled by Case-6 (deadend)" << endl;
 
     // This only matches when no strong cyclic solution exists
     if (*(SS->current_state) == *(SS->old_initial_state)) {
@@ -439,7 +435,7 @@ bool case6_deadend(PR2SearchStatus * SS) {
 
         cout << endl;
         cout << "Found the initial state to be a failed one. No strong cyclic plan exists." << endl;
-        cout << "Using the best policy found, with a score of " << PR2.solution.best->get_score() << endl;
+        cout << "Using the best policy found, with a score of " << PR2().solution.best->get_score() << endl;
         cout << endl;
 
         SS->sim->set_state(SS->old_initial_state);
@@ -450,15 +446,15 @@ bool case6_deadend(PR2SearchStatus * SS) {
         SS->snapshot_if_needbe();
 
         // Use the best policy we've found so far
-        if (PR2.solution.incumbent && (PR2.solution.best != PR2.solution.incumbent))
-            delete PR2.solution.incumbent;
-        PR2.solution.incumbent = PR2.solution.best;
+        if (PR2().solution.incumbent && (PR2().solution.best != PR2().solution.incumbent))
+            delete PR2().solution.incumbent;
+        PR2().solution.incumbent = PR2().solution.best;
 
         // Return true so the search stops
         return true;
 
     } else {
-        if (PR2.deadend.poison_search)
+        if (PR2().deadend.poison_search)
             SS->current_node->poison();
         SS->mark_current_state_failed();
         return false;
@@ -476,7 +472,7 @@ void strengthen_and_mark(PR2SearchStatus * status,
     // Strengthen the solsteps all the way back
     list<PolicyItem *> new_steps;
 
-    PR2.solution.incumbent->network->fixed_point_regression(
+    PR2().solution.incumbent->network->fixed_point_regression(
         previous_step, // src
         solstep, // old_dst
         solstep, // new_dst
@@ -490,20 +486,20 @@ void strengthen_and_mark(PR2SearchStatus * status,
 
     // If we've created new solsteps, then we need to update the bookeeping
     if (!new_steps.empty())
-        PR2.solution.incumbent->insert_steps(new_steps);
+        PR2().solution.incumbent->insert_steps(new_steps);
 
     // Clean things up if we're willing to spend the time doing it
-    if (PR2.psgraph.clear_dead_solsteps)
-        PR2.solution.incumbent->clear_dead_solsteps(status->solstep2searchnode);
+    if (PR2().psgraph.clear_dead_solsteps)
+        PR2().solution.incumbent->clear_dead_solsteps(status->solstep2searchnode);
 
     // Finally, update the marking if we can
     if (join_solstep)
         for (auto pred : join_solstep->get_predecessors())
-            PR2.solution.incumbent->network->fixed_point_marking(pred);
+            PR2().solution.incumbent->network->fixed_point_marking(pred);
 
     // Do the more advanced (i.e., complete) marking if set
-    if (PR2.psgraph.full_scd_marking)
-        PR2.solution.incumbent->network->full_marking();
+    if (PR2().psgraph.full_scd_marking)
+        PR2().solution.incumbent->network->full_marking();
 
 }
 
@@ -516,8 +512,8 @@ void strengthen_and_mark(PR2SearchStatus * status,
 
 void PR2SearchNode::poison() {
 
-    if (PR2.logging.poisoning) {
-        cout << "\nPOISONING(" << PR2.logging.id() << "): Starting a poisoning for the following node:" << endl;
+    if (PR2().logging.poisoning) {
+        cout << "\nPOISONING(" << PR2().logging.id() << "): Starting a poisoning for the following node:" << endl;
         dump();
     }
 
@@ -532,7 +528,7 @@ void PR2SearchNode::poison() {
     //  stopping condition in the recursion).
     if (previous_nodes.size() > 1) {
         poisoned = true;
-        PR2.deadend.poison_count++;
+        PR2().deadend.poison_count++;
         for (auto succ : next_nodes)
             succ->poison_recurse();
     }
@@ -556,7 +552,7 @@ void PR2SearchNode::poison_recurse() {
 
     // Otherwise, poison this node and continue
     poisoned = true;
-    PR2.deadend.poison_count++;
+    PR2().deadend.poison_count++;
     for (auto succ : next_nodes)
         succ->poison_recurse();
 }
@@ -604,8 +600,8 @@ void PR2SearchNode::record_snapshot(ofstream &outfile, string indent) {
 
 void PR2SearchNode::validate() {
 
-    if (PR2.logging.network_assertions) {
-        cout << "\nVALIDATIONS(" << PR2.logging.id() << "): Validating for the following node:" << endl;
+    if (PR2().logging.network_assertions) {
+        cout << "\nVALIDATIONS(" << PR2().logging.id() << "): Validating for the following node:" << endl;
         dump();
     }
 
@@ -647,8 +643,8 @@ void PR2SearchNode::validate() {
 
 PR2SearchNode * PR2SearchNode::expand(PR2SearchStatus * SS, SolutionStep * solstep) {
 
-    if (PR2.logging.fond_search_expanding) {
-        cout << "\nFONDSEARCH-EXPANSION(" << PR2.logging.id() << "): Expanding the current search node:" << endl;
+    if (PR2().logging.fond_search_expanding) {
+        cout << "\nFONDSEARCH-EXPANSION(" << PR2().logging.id() << "): Expanding the current search node:" << endl;
         dump();
         full_state->dump_pddl();
         cout << "...with SolStep..." << endl;
@@ -668,14 +664,14 @@ PR2SearchNode * PR2SearchNode::expand(PR2SearchStatus * SS, SolutionStep * solst
     PR2SearchNode * expected_node = NULL;
     PR2State * full_expected_state = generate_nondet_successors(full_state, &(solstep->op), successors);
     PR2State * expected_state = full_expected_state;
-    SolutionStep *expected_step = PR2.solution.incumbent->get_step(*expected_state);
+    SolutionStep *expected_step = PR2().solution.incumbent->get_step(*expected_state);
 
-    if (PR2.logging.fond_search_expanding) {
-        cout << "\nFONDSEARCH-EXPANSION(" << PR2.logging.id() << "): Expected successor state:" << endl;
+    if (PR2().logging.fond_search_expanding) {
+        cout << "\nFONDSEARCH-EXPANSION(" << PR2().logging.id() << "): Expected successor state:" << endl;
         full_expected_state->dump_pddl();
     }
 
-    if (PR2.localize.enabled && PR2.localize.generalize && expected_step) {
+    if (PR2().localize.enabled && PR2().localize.generalize && expected_step) {
         expected_state = new PR2State(*(expected_step->state));
         SS->created_states->push_back(expected_state);
     }
@@ -688,8 +684,8 @@ PR2SearchNode * PR2SearchNode::expand(PR2SearchStatus * SS, SolutionStep * solst
                                                      solstep,
                                                      succ->id);
 
-        if (PR2.logging.fond_search_expanding) {
-            cout << "\nFONDSEARCH-EXPANSION(" << PR2.logging.id() << "): Adding new PR2SearchNode:" << endl;
+        if (PR2().logging.fond_search_expanding) {
+            cout << "\nFONDSEARCH-EXPANSION(" << PR2().logging.id() << "): Adding new PR2SearchNode:" << endl;
             new_node->dump();
             succ->state->dump_pddl();
         }
@@ -709,19 +705,19 @@ PR2SearchNode * PR2SearchNode::expand(PR2SearchStatus * SS, SolutionStep * solst
 }
 
 bool pr2_node_comparison::operator() (const PR2SearchNode * n1, const PR2SearchNode * n2) {
-    if (PR2.fondsearch.node_preference == PR2.fondsearch.OPEN_LIST_STACK) {
+    if (PR2().fondsearch.node_preference == PR2().fondsearch.OPEN_LIST_STACK) {
         return (n1->id < n2->id);
-    } else if (PR2.fondsearch.node_preference == PR2.fondsearch.OPEN_LIST_QUEUE) {
+    } else if (PR2().fondsearch.node_preference == PR2().fondsearch.OPEN_LIST_QUEUE) {
         return (n1->id > n2->id);
-    } else if (PR2.fondsearch.node_preference == PR2.fondsearch.OPEN_LIST_NEAR_INIT) {
+    } else if (PR2().fondsearch.node_preference == PR2().fondsearch.OPEN_LIST_NEAR_INIT) {
         return (n1->parent_step->distance > n2->parent_step->distance);
-    } else if (PR2.fondsearch.node_preference == PR2.fondsearch.OPEN_LIST_AWAY_INIT) {
+    } else if (PR2().fondsearch.node_preference == PR2().fondsearch.OPEN_LIST_AWAY_INIT) {
         return (n1->parent_step->distance < n2->parent_step->distance);
-    } else if (PR2.fondsearch.node_preference == PR2.fondsearch.OPEN_LIST_RANDOM) {
-        return (PR2.rng.random() < 0.5);
+    } else if (PR2().fondsearch.node_preference == PR2().fondsearch.OPEN_LIST_RANDOM) {
+        return (PR2().rng.random() < 0.5);
     } else {
         cout << "\n\n\n\t\tError: Unrecognized open list type of " <<
-                PR2.fondsearch.node_preference << endl;
+                PR2().fondsearch.node_preference << endl;
         return false;
     }
 }
@@ -757,32 +753,33 @@ PR2SearchStatus::~PR2SearchStatus()  {
     poisoned = false;
 
     if (warm_start)
-        PR2.epoch.last_search_status = NULL;
+        PR2().epoch.last_search_status = NULL;
 }
 
 void PR2SearchStatus::init()  {
-    seen = new set<PR2State>();
+    seen = new PR2StateRegistry();
     open_list = new priority_queue< PR2SearchNode *, vector< PR2SearchNode * >, pr2_node_comparison >();
     failed_states = new vector<DeadendTuple *>();
     created_states = new vector<PR2State *>();
     solstep2searchnode = new map< SolutionStep* , set<PR2SearchNode *> *>();
-    state2searchnode = new map< PR2State, PR2SearchNode * >();
+    state2searchnode = new vector< PR2SearchNode * >();
 }
 
 bool PR2SearchStatus::keep_searching () {
-    return !open_list->empty() && (PR2.time.time_left());
+    return !open_list->empty() && (PR2().time.time_left());
 }
 
 bool PR2SearchStatus::repeat_state() {
-    return 0 != seen->count(*current_state);
+    current_state_id = seen->find(*current_state);
+    return -1 != current_state_id;
 }
 
 bool PR2SearchStatus::need_to_update_incumbent() {
-    return made_change || poisoned || (failed_states->size() > 0) || PR2.solution.incumbent->is_strong_cyclic();
+    return made_change || poisoned || (failed_states->size() > 0) || PR2().solution.incumbent->is_strong_cyclic();
 }
 
 bool PR2SearchStatus::need_to_update_deadends() {
-    return PR2.time.time_left() && PR2.deadend.enabled && (failed_states->size() > 0);
+    return PR2().time.time_left() && PR2().deadend.enabled && (failed_states->size() > 0);
 }
 
 bool PR2SearchStatus::need_to_rerun() {
@@ -813,8 +810,8 @@ void PR2SearchStatus::pop_next_node () {
         assert(!(current_node->previous_nodes.empty()));
         previous_node = current_node->previous_nodes[0];
         prev_to_curr_outcome = current_node->previous_node_outcomes[0];
-        int prev_op_ind = PR2.general.nondet_mapping[previous_step->op.nondet_index][prev_to_curr_outcome];
-        PR2OperatorProxy prev_op_proxy = PR2.proxy->get_operators()[prev_op_ind];
+        int prev_op_ind = PR2().task->actions.get_outcomes(previous_step->op.nondet_index)[prev_to_curr_outcome];
+        PR2OperatorProxy prev_op_proxy = PR2().proxy->get_operators()[prev_op_ind];
         previous_op = &prev_op_proxy;
     }
 }
@@ -825,37 +822,44 @@ void PR2SearchStatus::record_new_state () {
     //  the current node yet.
     assert(current_node);
     assert(current_node->previous_nodes.size() <= 1);
-    assert(state2searchnode->find(*current_state) == state2searchnode->end());
 
-    seen->insert(*current_state);
-    (*state2searchnode)[*current_state] = current_node;
+    record_seen_state(current_state, current_node);
 
-    if (PR2.logging.fond_search) {
-        cout << "\nFONDSEARCH(" << PR2.logging.id() << "): Tackling the current node / state:" << endl;
+    if (PR2().logging.fond_search) {
+        cout << "\nFONDSEARCH(" << PR2().logging.id() << "): Tackling the current node / state:" << endl;
         current_node->dump();
         current_state->dump_pddl();
     } else
         cout << "." << flush;
 }
 
+void PR2SearchStatus::record_seen_state(PR2State * state, PR2SearchNode * node) {
+    // New ids are handed out consecutively, so they line up with the
+    //  end of state2searchnode.
+    assert(-1 == seen->find(*state));
+    int id = seen->insert(*state);
+    assert(id == (int)state2searchnode->size());
+    state2searchnode->push_back(node);
+}
+
 void PR2SearchStatus::save_for_epoch() {
     // Add the most recent PR2SearchNode in case we start up another epoch
     if (current_node)
         open_list->push(current_node);
 
     cout << "Saving the FOND search state settings." << endl;
-    PR2.epoch.last_search_status = this;
+    PR2().epoch.last_search_status = this;
 }
 
 
 
 void PR2SearchStatus::update_incumbent_if_needbe() {
     if (need_to_update_incumbent()) {
-        if (PR2.solution.incumbent->better_than(PR2.solution.best)) {
-            cout << "Found a better policy of score " << PR2.solution.incumbent->get_score() << endl;
-            if (PR2.solution.best && (PR2.solution.best != PR2.solution.incumbent))
-                delete PR2.solution.best;
-            PR2.solution.best = PR2.solution.incumbent;
+        if (PR2().solution.incumbent->better_than(PR2().solution.best)) {
+            cout << "Found a better policy of score " << PR2().solution.incumbent->get_score() << endl;
+            if (PR2().solution.best && (PR2().solution.best != PR2().solution.incumbent))
+                delete PR2().solution.best;
+            PR2().solution.best = PR2().solution.incumbent;
         }
     }
 }
@@ -865,24 +869,24 @@ void PR2SearchStatus::update_deadends_if_needbe() {
         update_deadends(*failed_states);
         // We delete the policy so we can start from scratch next time with
         //  the deadends recorded.
-        if (PR2.solution.incumbent && (PR2.solution.best != PR2.solution.incumbent))
-            delete PR2.solution.incumbent;
-        PR2.solution.incumbent = new Solution(sim);
+        if (PR2().solution.incumbent && (PR2().solution.best != PR2().solution.incumbent))
+            delete PR2().solution.incumbent;
+        PR2().solution.incumbent = new Solution(sim);
         made_change = true;
     }
 }
 
 void PR2SearchStatus::mark_current_state_failed() {
-    if (PR2.deadend.enabled) {
-        if (PR2.deadend.generalize)
+    if (PR2().deadend.enabled) {
+        if (PR2().deadend.generalize)
             generalize_deadend(*(current_state));
 
         assert (NULL != current_state);
         assert (NULL != previous_node);
         assert (NULL != previous_op);
 
-        if (PR2.logging.fond_search) {
-            cout << "\nFONDSEARCH(" << PR2.logging.id() << "): Adding the following DE tuple:" << endl;
+        if (PR2().logging.fond_search) {
+            cout << "\nFONDSEARCH(" << PR2().logging.id() << "): Adding the following DE tuple:" << endl;
             cout << "Old state..." << endl;
             previous_node->full_state->dump_pddl();
             cout << "..applying " << previous_op->get_nondet_name() << " leading to..." << endl;
@@ -896,31 +900,31 @@ void PR2SearchStatus::mark_current_state_failed() {
 }
 
 void PR2SearchStatus::log_end_of_round() {
-    if (!(PR2.logging.fond_search))
+    if (!(PR2().logging.fond_search))
         cout << "}" << endl;
     cout << "\nCould not close " << failed_states->size() << " of " << num_fixed_states + failed_states->size() << " open leaf states." << endl;
     cout << "Investigated " << num_checked_states << " states for the strong cyclic plan." << endl;
 }
 
 void PR2SearchStatus::snapshot_if_needbe() {
-    if (PR2.logging.dump_snapshots) {
-        cout << "\nFONDSEARCH(" << PR2.logging.id() << "): Recording FOND Search Snapshot #" << PR2.logging.snapshot_num << "\n\n\n\n\n\n" << endl;
+    if (PR2().logging.dump_snapshots) {
+        cout << "\nFONDSEARCH(" << PR2().logging.id() << "): Recording FOND Search Snapshot #" << PR2().logging.snapshot_num << "\n\n\n\n\n\n" << endl;
         ofstream outfile;
-        outfile.open("fond-snapshot." + to_string(PR2.logging.snapshot_num++) + ".out", ios::out);
+        outfile.open("fond-snapshot." + to_string(PR2().logging.snapshot_num++) + ".out", ios::out);
         string label = last_round_type;
         if (current_node)
             label += " [node " + to_string(current_node->id) + "]";
-        PR2.solution.incumbent->record_snapshot(outfile, *solstep2searchnode, created_search_nodes, label);
+        PR2().solution.incumbent->record_snapshot(outfile, *solstep2searchnode, created_search_nodes, label);
         outfile.close();
     }
 }
 
 void PR2SearchStatus::validate_if_needbe() {
-    if (PR2.logging.validate_network_and_nodes) {
-        cout << "\nFONDSEARCH(" << PR2.logging.id() << "): Validating the solution steps..." << endl;
+    if (PR2().logging.validate_network_and_nodes) {
+        cout << "\nFONDSEARCH(" << PR2().logging.id() << "): Validating the solution steps..." << endl;
         for (auto ss : *solstep2searchnode)
             ss.first->validate(*(ss.second));
-        cout << "FONDSEARCH(" << PR2.logging.id() << "): Validating the search nodes..." << endl;
+        cout << "FONDSEARCH(" << PR2().logging.id() << "): Validating the search nodes..." << endl;
         if (created_search_nodes)
             for (auto sn : *created_search_nodes)
                 sn->validate();
@@ -46,18 +46,17 @@ struct PR2SearchStatus {
 
     Simulator *sim;
 
-    // Note: The seen and state2searchnode data structures are doing double
-    //       duty. Technically, we could get away with just the latter, but
-    //       we would face a log N complexity on the lookup instead of just
-    //       constant time, as is the case with the set seen.
+    // Note: Every full state is interned once in seen, and the id it is
+    //       given there indexes state2searchnode. A single hash lookup
+    //       thus answers both "have we seen it?" and "which node has it?".
 
     // Data structures that make up the FOND search progress and status
-    set< PR2State > * seen; // Keeps track of the full states we've seen
+    PR2StateRegistry * seen; // Keeps track of the full states we've seen
     priority_queue< PR2SearchNode *, vector< PR2SearchNode * >, pr2_node_comparison > * open_list; // Open list we traverse until strong cyclicity is proven
     vector< PR2State * > * created_states; // Used to clean up the created state objects
     vector< DeadendTuple * > * failed_states; // The failed states (used for creating deadends)
     map< SolutionStep* , set< PR2SearchNode * > * > * solstep2searchnode; // Mapping from a solstep to the nodes that are handled by that solstep
-    map< PR2State, PR2SearchNode * > * state2searchnode; // Mapping from the complete state to the appropriate (closed) search node
+    vector< PR2SearchNode * > * state2searchnode; // Mapping from the complete state's id in seen to the appropriate (closed) search node
     list< PR2SearchNode * > * created_search_nodes = NULL; // Just a list of the search nodes for printing and reference
 
     // Backups of the original goal and initial state
@@ -79,6 +78,7 @@ struct PR2SearchStatus {
     PR2SearchNode * previous_node; // The previous search node in the search
     SolutionStep * previous_step; // The solution step that led to the current state in the loop
     PR2State * current_state; // The current state in the loop
+    int current_state_id = -1; // The id of the current state in seen (-1 if it is new)
     PR2State * current_goal; // The current goal in the loop
     PR2OperatorProxy * previous_op; // The operator that took us from previous_node->full_state to the current state
     int prev_to_curr_outcome; // The outcome id that leads previous_node to current_node
@@ -101,6 +101,7 @@ struct PR2SearchStatus {
     // General methods for key parts of the search
     void pop_next_node ();
     void record_new_state ();
+    void record_seen_state(PR2State * state, PR2SearchNode * node);
     void save_for_epoch();
     void update_incumbent_if_needbe();
     void update_deadends_if_needbe();
@@ -137,7 +138,7 @@ struct PR2SearchNode {
     PR2SearchNode() : PR2SearchNode(NULL, NULL, NULL, NULL, -1) {}
 
     PR2SearchNode(PR2State * fs, PR2State * es, PR2SearchNode * pn, SolutionStep * pr, int s_id) :
-       full_state(fs), expected_state(es), parent_step(pr), matched_step(NULL), id(PR2.fondsearch.PR2NodeCount++), open(true), init(false), subsumed(false), poisoned(false)
+       full_state(fs), expected_state(es), parent_step(pr), matched_step(NULL), id(PR2().fondsearch.PR2NodeCount++), open(true), init(false), subsumed(false), poisoned(false)
     {
         if (pn) {
             assert(s_id >= 0);
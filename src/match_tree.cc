@@ -3,6 +3,39 @@
 
 #include "fd_integration/pr2_proxies.h"
 
+#include <atomic>
+#include <future>
+
+
+/*******************************************************************
+ * Parallel construction: the subtrees of a switch node are built
+ * independently, so a subtree with enough items is handed off to
+ * another thread whenever one of the spare build threads is free.
+ * Every item's varvals are filled in by the parent (in get_best_var)
+ * before its subtrees are built, and isset / value read the state
+ * without touching that cache, so the children never write to an
+ * item. Each item also ends up in exactly one subtree.
+ *******************************************************************/
+
+static const unsigned PARALLEL_BUILD_CUTOFF = 1024; // Minimum number of items for a subtree to get its own thread
+static atomic<int> spare_build_threads(0); // Threads (besides the caller's) still free to build subtrees
+
+static bool claim_build_thread() {
+    int spare = spare_build_threads.load();
+    while (spare > 0)
+        if (spare_build_threads.compare_exchange_weak(spare, spare - 1))
+            return true;
+    return false;
+}
+
+static void release_build_thread() {
+    spare_build_threads++;
+}
+
+void MatchtreeBase::set_build_threads(int num_threads) {
+    spare_build_threads = max(0, num_threads - 1);
+}
+
 
 /********
  * Base *
@@ -29,34 +62,50 @@ MatchtreeBase *MatchtreeBase::create_generator(list<MatchtreeItem *> &items, set
 
 int MatchtreeBase::get_best_var(list<MatchtreeItem *> &items, set<int> &vars_seen) {
 
-    // (count,varnum)
-    vector< pair<int,int> > var_count = vector< pair<int,int> >(PR2.general.num_vars);
-
-    for (unsigned i = 0; i < PR2.general.num_vars; i++) {
-        var_count[i] = pair<int,int>(0, (int)i);
-    }
+    // Occurrence counts are only ever touched for variables that some
+    //  item defines, so the work is proportional to the number of
+    //  defined entries rather than items x vars. The counters are kept
+    //  between calls (and per thread) and reset through touched_vars.
+    static thread_local vector<int> var_count;
+    static thread_local vector<int> touched_vars;
+    if (var_count.size() < PR2().task->num_vars)
+        var_count.resize(PR2().task->num_vars, 0);
 
     for (auto item : items) {
-        for (unsigned var = 0; var < PR2.general.num_vars; var++) {
-            if (item->isset((int)var)) {
-                var_count[var].first++;
-            }
+        for (auto varval : *(item->varvals())) {
+            if (0 == var_count[varval.first]++)
+                touched_vars.push_back(varval.first);
         }
     }
 
-    sort(var_count.begin(), var_count.end());
+    // Most frequent unseen variable, with ties going to the highest
+    //  variable id (matching the old sort-based selection)
+    int best_var = -1;
+    for (auto var : touched_vars) {
+        if ((vars_seen.count(var) <= 0) &&
+            ((-1 == best_var) ||
+             (var_count[var] > var_count[best_var]) ||
+             ((var_count[var] == var_count[best_var]) && (var > best_var))))
+            best_var = var;
+    }
+
+    for (auto var : touched_vars)
+        var_count[var] = 0;
+    touched_vars.clear();
 
-    for (int i = var_count.size() - 1; i >= 0; i--)
-        if (vars_seen.count(var_count[i].second) <= 0)
-            return var_count[i].second;
+    // No item mentions an unseen variable (e.g., the root of an empty
+    //  policy), so fall back on the highest unseen variable id
+    for (int var = PR2().task->num_vars - 1; (-1 == best_var) && (var >= 0); var--)
+        if (vars_seen.count(var) <= 0)
+            best_var = var;
 
-    assert(false);
-    return -1;
+    assert(-1 != best_var);
+    return best_var;
 }
 
 bool MatchtreeBase::item_done(MatchtreeItem *item, set<int> &vars_seen) {
-    for (unsigned var = 0; var < PR2.general.num_vars; var++)
-        if (item->isset(var) && (vars_seen.count(var) <= 0))
+    for (auto varval : *(item->varvals()))
+        if (vars_seen.count(varval.first) <= 0)
             return false;
 
     return true;
@@ -85,7 +134,7 @@ MatchtreeSwitch::MatchtreeSwitch(list<MatchtreeItem *> &items, set<int> &vars_se
     list<MatchtreeItem *> default_items;
 
     // Initialize the value_items
-    for (int i = 0; i < PR2.proxy->get_variables()[switch_var].get_domain_size(); i++)
+    for (int i = 0; i < PR2().proxy->get_variables()[switch_var].get_domain_size(); i++)
         value_items.push_back(list<MatchtreeItem *>());
 
     // Sort out the items into the proper bin
@@ -103,12 +152,27 @@ MatchtreeSwitch::MatchtreeSwitch(list<MatchtreeItem *> &items, set<int> &vars_se
 
     vars_seen.insert(switch_var);
 
-    // Create the switch generators
-    for (auto item_list : value_items)
-        generator_for_value.push_back(create_generator(item_list, vars_seen));
-
-    // Create the default generator
-    default_generator = create_generator(default_items, vars_seen);
+    // Create the switch generators and the default generator. Large
+    //  subtrees are handed to a spare thread (when there is one), each
+    //  with its own copy of vars_seen; everything else is built here.
+    generator_for_value.resize(value_items.size(), nullptr);
+    vector< future<void> > subtree_builds;
+    for (unsigned i = 0; i <= value_items.size(); i++) {
+        list<MatchtreeItem *> &item_list = (i < value_items.size()) ? value_items[i] : default_items;
+        MatchtreeBase * &gen = (i < value_items.size()) ? generator_for_value[i] : default_generator;
+        if ((item_list.size() >= PARALLEL_BUILD_CUTOFF) && claim_build_thread()) {
+            PR2Wrapper &context = PR2();
+            subtree_builds.push_back(async(launch::async, [this, &context, &item_list, &gen, vars_seen]() mutable {
+                PR2ContextBinding binding(context);
+                gen = create_generator(item_list, vars_seen);
+                release_build_thread();
+            }));
+        } else {
+            gen = create_generator(item_list, vars_seen);
+        }
+    }
+    for (auto &build : subtree_builds)
+        build.get();
 
     vars_seen.erase(switch_var);
 }
@@ -120,11 +184,11 @@ MatchtreeSwitch::~MatchtreeSwitch() {
 }
 
 void MatchtreeSwitch::dump(string indent) const {
-    cout << indent << "switch on " << PR2.proxy->get_variables()[switch_var].get_name() << endl;
+    cout << indent << "switch on " << PR2().proxy->get_variables()[switch_var].get_name() << endl;
     cout << indent << "immediately:" << endl;
     for (auto item : immediate_items)
         cout << indent << item->get_name() << endl;
-    for (int i = 0; i < PR2.proxy->get_variables()[switch_var].get_domain_size(); i++) {
+    for (int i = 0; i < PR2().proxy->get_variables()[switch_var].get_domain_size(); i++) {
         cout << indent << "case " << i << ":" << endl;
         generator_for_value[i]->dump(indent + "  ");
     }
@@ -142,12 +206,21 @@ void MatchtreeSwitch::generate_cpp_input(ofstream &outfile) const {
     default_generator->generate_cpp_input(outfile);
 }
 
+int MatchtreeSwitch::flatten(MatchtreeFlat &flat) const {
+    int node = flat.add_node(switch_var, immediate_items);
+    int slot = flat.add_children(node, generator_for_value.size());
+    for (auto child : generator_for_value)
+        flat.set_child(slot++, child->flatten(flat));
+    flat.set_default_child(node, default_generator->flatten(flat));
+    return node;
+}
+
 MatchtreeBase *MatchtreeSwitch::update_policy(list<MatchtreeItem *> &items, set<int> &vars_seen) {
     vector< list<MatchtreeItem *> > value_items;
     list<MatchtreeItem *> default_items;
 
     // Initialize the value_items
-    for (int i = 0; i < PR2.proxy->get_variables()[switch_var].get_domain_size(); i++)
+    for (int i = 0; i < PR2().proxy->get_variables()[switch_var].get_domain_size(); i++)
         value_items.push_back(list<MatchtreeItem *>());
 
     // Sort out the items into the proper bin
@@ -262,6 +335,10 @@ void MatchtreeLeaf::generate_cpp_input(ofstream &outfile) const {
         outfile << item->get_name() << endl;
 }
 
+int MatchtreeLeaf::flatten(MatchtreeFlat &flat) const {
+    return flat.add_node(-1, applicable_items);
+}
+
 MatchtreeBase *MatchtreeLeaf::update_policy(list<MatchtreeItem *> &items, set<int> &vars_seen) {
     if (items.empty())
         return NULL;
@@ -332,3 +409,72 @@ MatchtreeBase *MatchtreeEmpty::update_policy(list<MatchtreeItem *> &items, set<i
     else
         return new MatchtreeSwitch(items, vars_seen);
 }
+
+
+/********
+ * Flat *
+ ********/
+
+void MatchtreeFlat::clear() {
+    nodes.clear();
+    items.clear();
+    children.clear();
+    subtree_best.clear();
+    parent.clear();
+    item_node.clear();
+    item_index.clear();
+    root = -1;
+}
+
+void MatchtreeFlat::build(const MatchtreeBase *tree) {
+    clear();
+    if (tree)
+        root = tree->flatten(*this);
+}
+
+int MatchtreeFlat::add_node(int switch_var, const list<MatchtreeItem *> &node_items) {
+    Node node;
+    node.switch_var = switch_var;
+    node.items_begin = items.size();
+    items.insert(items.end(), node_items.begin(), node_items.end());
+    node.items_end = items.size();
+    node.children_begin = -1;
+    node.num_values = 0;
+    node.default_child = -1;
+    nodes.push_back(node);
+    return nodes.size() - 1;
+}
+
+int MatchtreeFlat::add_children(int node, int num_values) {
+    nodes[node].children_begin = children.size();
+    nodes[node].num_values = num_values;
+    children.resize(children.size() + num_values, -1);
+    return nodes[node].children_begin;
+}
+
+vector<int> &MatchtreeFlat::traversal_stack() {
+    static thread_local vector<int> stack;
+    return stack;
+}
+
+void MatchtreeFlat::generate_consistent_items(const PR2State &curr, vector<MatchtreeItem *> &result, bool only_if_relevant) const {
+    visit_consistent_items(curr, only_if_relevant, [&result](MatchtreeItem *item) {
+        result.push_back(item);
+        return true;
+    });
+}
+
+void MatchtreeFlat::generate_entailed_items(const PR2State &curr, vector<MatchtreeItem *> &result) const {
+    visit_entailed_items(curr, [&result](MatchtreeItem *item) {
+        result.push_back(item);
+        return true;
+    });
+}
+
+bool MatchtreeFlat::check_consistent_match(const PR2State &curr) const {
+    return !visit_consistent_items(curr, false, [](MatchtreeItem *) { return false; });
+}
+
+bool MatchtreeFlat::check_entailed_match(const PR2State &curr) const {
+    return !visit_entailed_items(curr, [](MatchtreeItem *) { return false; });
+}
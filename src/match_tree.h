@@ -8,21 +8,24 @@
 #include <cassert>
 #include <algorithm>
 #include <map>
+#include <unordered_map>
 
 #include "pr2.h"
 #include "fd_integration/partial_state.h"
 
 class PR2State;
+class MatchtreeFlat;
 
 using namespace std;
 
 struct MatchtreeItem {
 public:
-    virtual bool entails(int var, int val) = 0;
-    virtual bool consistent(int var, int val) = 0;
-    virtual bool is_relevant(const PR2State &curr) = 0;
-    virtual bool isset(int var) = 0;
-    virtual int value(int var) = 0;
+    virtual bool entails(int var, int val) const = 0;
+    virtual bool consistent(int var, int val) const = 0;
+    virtual bool is_relevant(const PR2State &curr) const = 0;
+    virtual bool isset(int var) const = 0;
+    virtual int value(int var) const = 0;
+    virtual vector< pair<int,int> > * varvals() = 0; // Only the defined (var,val) pairs
     virtual string get_name() = 0;
     virtual void dump() const = 0;
     virtual ~MatchtreeItem() {}
@@ -38,6 +41,10 @@ public:
     MatchtreeBase *create_generator(list<MatchtreeItem *> &items, set<int> &vars_seen);
     virtual void generate_cpp_input(ofstream &outfile) const = 0;
 
+    // Appends this subtree to the flat copy and returns the index of
+    //  its node (-1 if the subtree can never match anything)
+    virtual int flatten(MatchtreeFlat &flat) const = 0;
+
     virtual void generate_consistent_items(const PR2State &curr, vector<MatchtreeItem *> &items, bool only_if_relevant) = 0;
     virtual void generate_entailed_items(const PR2State &curr, vector<MatchtreeItem *> &items) = 0;
 
@@ -45,6 +52,9 @@ public:
     virtual bool check_entailed_match(const PR2State &curr) = 0;
 
     int get_best_var(list<MatchtreeItem *> &items, set<int> &vars_seen);
+
+    // Number of threads that may be used when building the tree in bulk
+    static void set_build_threads(int num_threads);
     bool item_done(MatchtreeItem *item, set<int> &vars_seen);
 };
 
@@ -64,6 +74,7 @@ public:
 
     virtual void dump(string indent) const;
     virtual void generate_cpp_input(ofstream &outfile) const;
+    virtual int flatten(MatchtreeFlat &flat) const;
 
     virtual MatchtreeBase *update_policy(list<MatchtreeItem *> &items, set<int> &vars_seen);
 
@@ -81,6 +92,7 @@ public:
 
     virtual void dump(string indent) const;
     virtual void generate_cpp_input(ofstream &outfile) const;
+    virtual int flatten(MatchtreeFlat &flat) const;
 
     virtual MatchtreeBase *update_policy(list<MatchtreeItem *> &items, set<int> &vars_seen);
 
@@ -95,6 +107,7 @@ class MatchtreeEmpty : public MatchtreeBase {
 public:
     virtual void dump(string indent) const;
     virtual void generate_cpp_input(ofstream &outfile) const;
+    virtual int flatten(MatchtreeFlat &) const { return -1; }
 
     virtual MatchtreeBase *update_policy(list<MatchtreeItem *> &items, set<int> &vars_seen);
 
@@ -106,4 +119,256 @@ public:
 };
 
 
+/*******************************************************************
+ * A compacted, read-only copy of a match tree. Nodes live in one
+ * array and refer to their children by index, and every node's items
+ * are a contiguous range of a single item array. Queries walk the
+ * nodes with an explicit stack rather than through virtual calls,
+ * and report items in the same order as the pointer-based tree.
+ *******************************************************************/
+class MatchtreeFlat {
+    struct Node {
+        int switch_var; // -1 for a leaf
+        int items_begin; // Range of the node's items in items
+        int items_end;
+        int children_begin; // Child for every value of switch_var (-1 if empty)
+        int num_values;
+        int default_child; // Child for items that don't mention switch_var
+    };
+
+    vector<Node> nodes;
+    vector<MatchtreeItem *> items;
+    vector<int> children;
+    int root = -1;
+
+    // Optional ranking: the index (in items) of the best item anywhere
+    //  in each node's subtree, or -1 if the subtree has no items. Lets
+    //  best-item lookups skip subtrees that can't beat the current best.
+    vector<int> subtree_best;
+    // Filled in with the ranking, so a single item can be re-ranked by
+    //  walking from its node up to the root.
+    vector<int> parent; // Parent of every node (-1 for the root)
+    vector<int> item_node; // Node that holds every item
+    unordered_map<MatchtreeItem *, int> item_index; // Position of every item in items
+
+    template <class Compare>
+    void rank_node(int n, Compare &better) {
+        const Node &node = nodes[n];
+        int &best = subtree_best[n];
+        best = -1;
+        auto take = [&](int candidate) {
+            if ((-1 != candidate) && ((-1 == best) || better(items[candidate], items[best])))
+                best = candidate;
+        };
+        for (int i = node.items_begin; i < node.items_end; i++)
+            take(i);
+        for (int v = 0; v < node.num_values; v++) {
+            int child = children[node.children_begin + v];
+            if (-1 != child)
+                take(subtree_best[child]);
+        }
+        if (-1 != node.default_child)
+            take(subtree_best[node.default_child]);
+    }
+
+    // Per-thread scratch stack shared by every traversal. A traversal
+    //  only works above the height it started at, so a visitor is free
+    //  to run other (nested) queries.
+    static vector<int> &traversal_stack();
+
+public:
+    void build(const MatchtreeBase *tree);
+    void clear();
+    bool empty() const { return -1 == root; }
+
+    // Used by MatchtreeBase::flatten
+    int add_node(int switch_var, const list<MatchtreeItem *> &node_items);
+    int add_children(int node, int num_values);
+    void set_child(int slot, int child) { children[slot] = child; }
+    void set_default_child(int node, int child) { nodes[node].default_child = child; }
+
+    // The visitors are called with the matching items in the same order
+    //  as the recursive versions in MatchtreeSwitch would report them
+    //  (immediate items, then the value children, then the default
+    //  child), which is why the children are pushed in reverse. Both
+    //  return false if the visitor stopped the traversal early.
+    template <class Visitor>
+    bool visit_consistent_items(const PR2State &curr, bool only_if_relevant, Visitor &&visit) const {
+        if (empty())
+            return true;
+
+        vector<int> &stack = traversal_stack();
+        size_t base = stack.size();
+        stack.push_back(root);
+
+        while (stack.size() > base) {
+            const Node &node = nodes[stack.back()];
+            stack.pop_back();
+
+            for (int i = node.items_begin; i < node.items_end; i++) {
+                if ((!only_if_relevant || items[i]->is_relevant(curr)) && !visit(items[i])) {
+                    stack.resize(base);
+                    return false;
+                }
+            }
+
+            if (-1 == node.switch_var)
+                continue;
+
+            if (-1 != node.default_child)
+                stack.push_back(node.default_child);
+
+            int val = curr[node.switch_var];
+            if (-1 != val) {
+                int child = children[node.children_begin + val];
+                if (-1 != child)
+                    stack.push_back(child);
+            } else {
+                for (int v = node.num_values - 1; v >= 0; v--) {
+                    int child = children[node.children_begin + v];
+                    if (-1 != child)
+                        stack.push_back(child);
+                }
+            }
+        }
+
+        return true;
+    }
+
+    template <class Visitor>
+    bool visit_entailed_items(const PR2State &curr, Visitor &&visit) const {
+        if (empty())
+            return true;
+
+        vector<int> &stack = traversal_stack();
+        size_t base = stack.size();
+        stack.push_back(root);
+
+        while (stack.size() > base) {
+            const Node &node = nodes[stack.back()];
+            stack.pop_back();
+
+            for (int i = node.items_begin; i < node.items_end; i++) {
+                if (!visit(items[i])) {
+                    stack.resize(base);
+                    return false;
+                }
+            }
+
+            if (-1 == node.switch_var)
+                continue;
+
+            if (-1 != node.default_child)
+                stack.push_back(node.default_child);
+
+            int val = curr[node.switch_var];
+            if (-1 != val) {
+                int child = children[node.children_begin + val];
+                if (-1 != child)
+                    stack.push_back(child);
+            }
+        }
+
+        return true;
+    }
+
+    // Computes subtree_best according to the strict ordering better(a,b)
+    //  (true if a ranks before b). Nodes are laid out parents-first, so
+    //  a single backwards pass sees every child before its parent.
+    template <class Compare>
+    void rank_items(Compare better) {
+        subtree_best.assign(nodes.size(), -1);
+        parent.assign(nodes.size(), -1);
+        item_node.assign(items.size(), -1);
+        item_index.clear();
+        for (int n = nodes.size() - 1; n >= 0; n--) {
+            const Node &node = nodes[n];
+            for (int i = node.items_begin; i < node.items_end; i++) {
+                item_node[i] = n;
+                item_index[items[i]] = i;
+            }
+            for (int v = 0; v < node.num_values; v++) {
+                int child = children[node.children_begin + v];
+                if (-1 != child)
+                    parent[child] = n;
+            }
+            if (-1 != node.default_child)
+                parent[node.default_child] = n;
+            rank_node(n, better);
+        }
+    }
+
+    // Brings the ranking up to date after the rank of a single item has
+    //  changed. Only the nodes from the item's up to the root can be
+    //  affected, and we stop early once a node's best is neither changed
+    //  nor the item itself.
+    template <class Compare>
+    void rerank_item(MatchtreeItem *item, Compare better) {
+        assert(is_ranked());
+        auto it = item_index.find(item);
+        if (it == item_index.end())
+            return;
+        int index = it->second;
+        for (int n = item_node[index]; -1 != n; n = parent[n]) {
+            int old_best = subtree_best[n];
+            rank_node(n, better);
+            if ((subtree_best[n] == old_best) && (old_best != index))
+                break;
+        }
+    }
+    bool is_ranked() const { return subtree_best.size() == nodes.size(); }
+
+    // The best entailed item (according to the ranking's ordering) that
+    //  is accepted by the filter, or nullptr. The result is the same as
+    //  taking the minimum over generate_entailed_items, but subtrees whose
+    //  best item can't beat the current best are never visited.
+    template <class Compare, class Filter>
+    MatchtreeItem * find_best_entailed_item(const PR2State &curr, Compare better, Filter accept) const {
+        assert(is_ranked());
+        MatchtreeItem * best = nullptr;
+        if (empty())
+            return best;
+
+        vector<int> &stack = traversal_stack();
+        size_t base = stack.size();
+        stack.push_back(root);
+
+        while (stack.size() > base) {
+            int n = stack.back();
+            stack.pop_back();
+
+            int sub_best = subtree_best[n];
+            if ((-1 == sub_best) || (best && !better(items[sub_best], best)))
+                continue;
+
+            const Node &node = nodes[n];
+            for (int i = node.items_begin; i < node.items_end; i++)
+                if ((!best || better(items[i], best)) && accept(items[i]))
+                    best = items[i];
+
+            if (-1 == node.switch_var)
+                continue;
+
+            if (-1 != node.default_child)
+                stack.push_back(node.default_child);
+
+            int val = curr[node.switch_var];
+            if (-1 != val) {
+                int child = children[node.children_begin + val];
+                if (-1 != child)
+                    stack.push_back(child);
+            }
+        }
+
+        return best;
+    }
+
+    void generate_consistent_items(const PR2State &curr, vector<MatchtreeItem *> &result, bool only_if_relevant) const;
+    void generate_entailed_items(const PR2State &curr, vector<MatchtreeItem *> &result) const;
+
+    bool check_consistent_match(const PR2State &curr) const;
+    bool check_entailed_match(const PR2State &curr) const;
+};
+
+
 #endif
@@ -17,7 +17,7 @@ void PSGraph::fixed_point_regression(SolutionStep * src,
 
     #ifndef NDEBUG
     if (src) {
-        if (PR2.logging.log_solstep(src->step_id)) {
+        if (PR2().logging.log_solstep(src->step_id)) {
             cout << "FPR For SolutionStep:" << endl;
             src->dump();
         }
@@ -31,14 +31,14 @@ void PSGraph::fixed_point_regression(SolutionStep * src,
     // Default base case is when we've hit the start of the graph, in
     //  which case we update the graph's init to the newly generated one
     if (!(src)) {
-        if (PR2.logging.psgraph)
-            cout << "\nPSGRAPH(" << PR2.logging.id() << "): Base case -- at the front of the graph" << endl;
+        if (PR2().logging.psgraph)
+            cout << "\nPSGRAPH(" << PR2().logging.id() << "): Base case -- at the front of the graph" << endl;
         init = new_dst;
         return;
     }
 
-    if (PR2.logging.psgraph) {
-        cout << "\nPSGRAPH(" << PR2.logging.id() << "): Called with src / old_dst / new_dst solsteps (make_connection = " << make_connection << "):" << endl;
+    if (PR2().logging.psgraph) {
+        cout << "\nPSGRAPH(" << PR2().logging.id() << "): Called with src / old_dst / new_dst solsteps (make_connection = " << make_connection << "):" << endl;
         if (src)
             src->dump();
         else
@@ -52,7 +52,7 @@ void PSGraph::fixed_point_regression(SolutionStep * src,
         else
             cout << "new_dst DNE!" << endl;
 
-        cout << "PSGRAPH(" << PR2.logging.id() << "): src / dst search nodes:" << endl;
+        cout << "PSGRAPH(" << PR2().logging.id() << "): src / dst search nodes:" << endl;
         if (src_node)
             src_node->dump();
         else
@@ -64,7 +64,7 @@ void PSGraph::fixed_point_regression(SolutionStep * src,
     }
 
     #ifndef NDEBUG
-    if (PR2.logging.psgraph_condensed) {
+    if (PR2().logging.psgraph_condensed) {
         int srcid = -1, dstid = -1, ndstid = -1;
         if (src) srcid = src->step_id;
         if (old_dst) dstid = old_dst->step_id;
@@ -79,9 +79,9 @@ void PSGraph::fixed_point_regression(SolutionStep * src,
 
     // Find the determinized operator leading from src to dst
     assert(successor_id_for_dst >= 0);
-    assert(successor_id_for_dst < (int)(PR2.general.nondet_mapping[src->op.nondet_index].size()));
-    int op_ind = PR2.general.nondet_mapping[src->op.nondet_index][successor_id_for_dst];
-    PR2OperatorProxy _op = PR2.proxy->get_operators()[op_ind];
+    assert(successor_id_for_dst < (int)(PR2().task->actions.get_outcomes(src->op.nondet_index).size()));
+    int op_ind = PR2().task->actions.get_outcomes(src->op.nondet_index)[successor_id_for_dst];
+    PR2OperatorProxy _op = PR2().proxy->get_operators()[op_ind];
     PR2OperatorProxy * op = &_op;
 
     assert(op);
@@ -97,8 +97,8 @@ void PSGraph::fixed_point_regression(SolutionStep * src,
     //  successor nodes appropriately.
     if ((1 == solstep2searchnode[src]->size()) && src->state->entails(*updated_state)) {
 
-        if (PR2.logging.psgraph)
-            cout << "\nPSGRAPH(" << PR2.logging.id() << "): Base case -- found a solstep stronger than the regression with just a single node." << endl;
+        if (PR2().logging.psgraph)
+            cout << "\nPSGRAPH(" << PR2().logging.id() << "): Base case -- found a solstep stronger than the regression with just a single node." << endl;
 
         // Re-wire the solsteps
         if (src->has_successor(successor_id_for_dst)) {
@@ -136,8 +136,8 @@ void PSGraph::fixed_point_regression(SolutionStep * src,
     //  the network back to the init node (i.e., there will be a cycle that
     //  contains the init node, and the entails base case is what triggers).
     if ((src == init) && (0 == solstep2searchnode[src]->size())) {
-        if (PR2.logging.psgraph)
-            cout << "\nPSGRAPH(" << PR2.logging.id() << "): Updating to a new init node." << endl;
+        if (PR2().logging.psgraph)
+            cout << "\nPSGRAPH(" << PR2().logging.id() << "): Updating to a new init node." << endl;
         init = new_src;
     }
 
@@ -162,13 +162,13 @@ void PSGraph::fixed_point_regression(SolutionStep * src,
     for (auto succss : new_src->get_successors()) {
         outcome += 1;
         if (succss) {
-            int op_ind = PR2.general.nondet_mapping[new_src->op.nondet_index][outcome];
-            PR2OperatorProxy used_op = PR2.proxy->get_operators()[op_ind];
+            int op_ind = PR2().task->actions.get_outcomes(new_src->op.nondet_index)[outcome];
+            PR2OperatorProxy used_op = PR2().proxy->get_operators()[op_ind];
             assert(new_src->state->entails(*(succss->state->regress(used_op, src_node->full_state))));
         }
     }
 
-    if (PR2.logging.psgraph_condensed)
+    if (PR2().logging.psgraph_condensed)
         cout << " (" << src_node->previous_nodes.size() << ")" << endl;
     #endif
 
@@ -205,7 +205,7 @@ void PSGraph::fixed_point_marking(SolutionStep * node) {
             return;
 
     // Otherwise, this node is all set, and we should mark / recurse
-    node->is_sc = true;
+    node->mark_sc();
     for (auto pred : node->get_predecessors())
         fixed_point_marking(pred);
 }
@@ -247,7 +247,7 @@ void PSGraph::full_marking() {
     // Finally, mark all the remaining potential ones as strong cyclic
     for (auto s : unmarked)
         if (not_sc.find(s) == not_sc.end())
-            s->is_sc = true;
+            s->mark_sc();
 
 }
 
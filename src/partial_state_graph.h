@@ -13,6 +13,8 @@ struct PSGraph {
 
     set<SolutionStep *> steps;
 
+    Policy *policy = nullptr; // The policy holding the steps (told when a step's rank changes)
+
     PSGraph();
     ~PSGraph();
 
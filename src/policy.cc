@@ -5,7 +5,7 @@
 int PolicyItem::generality() {
     if (-1 != _generality) {
         _generality = 0;
-        for (unsigned i = 0; i < PR2.general.num_vars; i++) {
+        for (unsigned i = 0; i < PR2().task->num_vars; i++) {
             if (-1 == value(i)) {
                 _generality++;
             }
@@ -15,15 +15,16 @@ int PolicyItem::generality() {
     return _generality;
 }
 
-bool PolicyItem::is_relevant(const PR2State &curr) {
-    for (unsigned i = 0; i < PR2.general.num_vars; i++)
+bool PolicyItem::is_relevant(const PR2State &curr) const {
+    for (unsigned i = 0; i < PR2().task->num_vars; i++)
         if (isset(i) && (!curr.is_undefined(i)))
             return true;
     return false;
 }
 
-int PolicyItem::value(int var) {
-    return (*state)[var];
+int PolicyItem::value(int var) const {
+    // Read through a const state, so the query never touches its caches
+    return static_cast<const PR2State &>(*state)[var];
 }
 
 vector< pair<int,int> > * PolicyItem::varvals() {
@@ -59,10 +60,10 @@ void Policy::write_policy(string fname, bool fsap) {
         outfile << "\nIf holds:";
         PR2State *s = item->state;
 
-        for (unsigned i = 0; i < PR2.general.num_vars; i++) {
+        for (unsigned i = 0; i < PR2().task->num_vars; i++) {
             if (!(s->is_undefined(i))) {
                 outfile << " ";
-                outfile << PR2.proxy->get_variables()[i].get_name() << ":" << (*s)[i];
+                outfile << PR2().proxy->get_variables()[i].get_name() << ":" << (*s)[i];
             }
         }
         outfile << endl;
@@ -106,20 +107,22 @@ void Policy::update_policy(list<PolicyItem *> &reg_items) {
         root = new MatchtreeSwitch(mtis, vars_seen);
     all_items.insert(all_items.end(), reg_items.begin(), reg_items.end());
 
+    build_flat();
+
 }
 
-bool Policy::check_consistent_match(const PR2State &curr) {
-    if (root)
-        return root->check_consistent_match(curr);
-    else
-        return false;
+void Policy::build_flat() {
+    flat.build(root);
+    if (ranking)
+        flat.rank_items(ranking);
 }
 
-bool Policy::check_entailed_match(const PR2State &curr) {
-    if (root)
-        return root->check_entailed_match(curr);
-    else
-        return false;
+bool Policy::check_consistent_match(const PR2State &curr) const {
+    return flat.check_consistent_match(curr);
+}
+
+bool Policy::check_entailed_match(const PR2State &curr) const {
+    return flat.check_entailed_match(curr);
 }
 
 void Policy::rebuild() {
@@ -139,6 +142,7 @@ void Policy::rebuild() {
     set<int> vars_seen;
     delete root;
     root = new MatchtreeSwitch(mtis, vars_seen);
+    build_flat();
 
     all_items.swap(new_items);
 
@@ -1,6 +1,8 @@
 #ifndef POLICY_H
 #define POLICY_H
 
+#include <functional>
+
 #include "pr2.h"
 
 #include "match_tree.h"
@@ -26,12 +28,12 @@ struct PolicyItem : MatchtreeItem {
     }
 
     int generality();
-    bool is_relevant(const PR2State &curr);
+    bool is_relevant(const PR2State &curr) const;
 
-    int value(int var);
-    bool entails(int var, int val) { return value(var) == val; }
-    bool isset(int var) { return value(var) != -1; }
-    bool consistent(int var, int val) {
+    int value(int var) const;
+    bool entails(int var, int val) const { return value(var) == val; }
+    bool isset(int var) const { return !static_cast<const PR2State &>(*state).is_undefined(var); }
+    bool consistent(int var, int val) const {
         return entails(var,val) || !isset(var);
     }
 
@@ -42,11 +44,18 @@ struct PolicyItem : MatchtreeItem {
 class Policy {
 
     MatchtreeBase *root;
+    MatchtreeFlat flat; // Compacted copy of root that every query runs on
+    function<bool(MatchtreeItem *, MatchtreeItem *)> ranking; // Ordering used by find_best_entailed_item (empty if not needed)
 
     // private copy constructor to forbid copying;
     // typical idiom for classes with non-trivial destructors
     Policy(const Policy &copy);
 
+    // The flat copy (and its ranking) is brought up to date whenever the
+    //  policy changes, so the queries never write to the policy and can
+    //  be run from several threads at once.
+    void build_flat();
+
 public:
 
     Policy() : root(nullptr) {};
@@ -61,8 +70,8 @@ public:
     void add_item(PolicyItem *item);
     void update_policy(list<PolicyItem *> &reg_items);
 
-    bool check_consistent_match(const PR2State &curr);
-    bool check_entailed_match(const PR2State &curr);
+    bool check_consistent_match(const PR2State &curr) const;
+    bool check_entailed_match(const PR2State &curr) const;
 
     void rebuild();
 
@@ -72,21 +81,61 @@ public:
 
     // We need to define these inline since they are templated
     template <class T>
-    void generate_consistent_items(const PR2State &curr, vector<T *> &reg_items, bool only_if_relevant) {
-        vector<MatchtreeItem *> mtis;
-        if (root)
-            root->generate_consistent_items(curr, mtis, only_if_relevant);
-        for (auto item : mtis)
-            reg_items.push_back((T *)item);
+    void generate_consistent_items(const PR2State &curr, vector<T *> &reg_items, bool only_if_relevant) const {
+        visit_consistent_items<T>(curr, only_if_relevant, [&reg_items](T *item) {
+            reg_items.push_back(item);
+            return true;
+        });
     }
 
     template <class T>
-    void generate_entailed_items(const PR2State &curr, vector<T *> &reg_items) {
-        vector<MatchtreeItem *> mtis;
-        if (root)
-            root->generate_entailed_items(curr, mtis);
-        for (auto item : mtis)
-            reg_items.push_back((T *)item);
+    void generate_entailed_items(const PR2State &curr, vector<T *> &reg_items) const {
+        visit_entailed_items<T>(curr, [&reg_items](T *item) {
+            reg_items.push_back(item);
+            return true;
+        });
+    }
+
+    // Stream the matching items to the visitor without collecting them.
+    //  The visitor returns false to stop early, in which case so do these.
+    template <class T, class Visitor>
+    bool visit_consistent_items(const PR2State &curr, bool only_if_relevant, Visitor &&visit) const {
+        return flat.visit_consistent_items(curr, only_if_relevant, [&visit](MatchtreeItem *item) {
+            return visit((T *)item);
+        });
+    }
+
+    template <class T, class Visitor>
+    bool visit_entailed_items(const PR2State &curr, Visitor &&visit) const {
+        return flat.visit_entailed_items(curr, [&visit](MatchtreeItem *item) {
+            return visit((T *)item);
+        });
+    }
+
+    // Sets the ordering for find_best_entailed_item. The per-subtree
+    //  ranking is then kept up to date along with the flat copy.
+    template <class T, class Compare>
+    void set_ranking(Compare better) {
+        ranking = [better](MatchtreeItem *a, MatchtreeItem *b) mutable { return better((T *)a, (T *)b); };
+        flat.rank_items(ranking);
+    }
+
+    // Lets the policy know that the item's rank may have changed, so
+    //  that its path in the ranking is fixed right away.
+    void rank_changed(PolicyItem *item) {
+        if (ranking)
+            flat.rerank_item((MatchtreeItem *)item, ranking);
+    }
+
+    // Best-ranked entailed item that passes the filter (nullptr if none).
+    //  better has to be the ordering given to set_ranking (it is passed
+    //  again so the lookup doesn't go through the std::function).
+    template <class T, class Compare, class Filter>
+    T * find_best_entailed_item(const PR2State &curr, Compare better, Filter accept) const {
+        assert(ranking);
+        auto compare = [&better](MatchtreeItem *a, MatchtreeItem *b) { return better((T *)a, (T *)b); };
+        return (T *)flat.find_best_entailed_item(curr, compare,
+            [&accept](MatchtreeItem *item) { return accept((T *)item); });
     }
 
     void record_snapshot(ofstream &outfile, string indent) {
@@ -1,7 +1,9 @@
 
 #include "pr2.h"
 
+#include "deadend.h"
 #include "fond_search.h"
+#include "match_tree.h"
 #include "partial_state_graph.h"
 #include "policy.h"
 #include "regression.h"
@@ -13,21 +15,28 @@
 
 bool PR2Wrapper::run_pr2() {
 
-    PR2.time.start();
+    PR2().time.start();
+
+    // Large policies (regressable operators, FSAPs, rebuilt solutions)
+    //  are built with the subtrees spread over the available threads
+    MatchtreeBase::set_build_threads(PR2().general.num_threads);
+
+    // Set up the task data first, as every PR2State depends on it
+    PR2().initialize_task();
 
     // Create the nondet mapping required
-    PR2.generate_nondet_operator_mappings();
+    PR2().generate_nondet_operator_mappings();
 
     //Manually construct engine
     plugins::Options opts = plugins::Options();
     opts.set("cost_type", OperatorCost::NORMAL);
     //Is bound used at all?
     opts.set("bound", 999999);
-    opts.set("max_time", PR2.time.limit);
+    opts.set("max_time", PR2().time.limit);
     opts.set("description", "PR2_Search");
     opts.set("verbosity", utils::Verbosity::NORMAL);
     
-    PR2.pr2_engine = make_shared<pr2_search::PR2Search>(opts);
+    PR2().pr2_engine = make_shared<pr2_search::PR2Search>(opts);
 
     // // Cast SearchAlgorithm shared_ptr to PR2Search shared_ptr
     // pr2_engine = dynamic_pointer_cast<pr2_search::PR2Search>(engine);
@@ -35,48 +44,37 @@ bool PR2Wrapper::run_pr2() {
     /**********************************
      * Initialize the data structures *
      **********************************/
-    PR2.general.num_vars = PR2.proxy->get_variables().size();
-
-    PR2.general.goal_op = PR2.proxy->get_goal_operator();
-
-
-    for (auto x : PR2.proxy->get_goals()) {
-        PR2.localize.original_goal.push_back(pair<int, int>(x.get_variable().get_id(), x.get_value()));
-    }
-
-    if (PR2.deadend.enabled)
-        generate_regressable_ops();
 
     // We create the policies even if we aren't using deadends, as
     //  they may be consulted by certain parts of the code.
-    PR2.deadend.policy = new Policy();
-    PR2.deadend.states = new Policy();
-    PR2.deadend.online_policy = new Policy();
+    PR2().deadend.policy = new Policy();
+    PR2().deadend.states = new Policy();
+    PR2().deadend.online_policy = new Policy();
 
     // We also create a deadend heuristic computer
-    PR2.deadend.reachability_heuristic = PR2.proxy->new_deadend_heuristic();
+    PR2().deadend.reachability_heuristic = PR2().proxy->new_deadend_heuristic();
 
     /**********************
      * Handle Time Limits *
      **********************/
 
-    cout << "\nTotal allotted time (s): " << PR2.time.limit << endl;
+    cout << "\nTotal allotted time (s): " << PR2().time.limit << endl;
 
     // If we are going to do a final FSAP-free round, then we modify the
     //  time limits to give a 50/50 split between the main phase and final
     //  round phase
     double time_ratio = 0.5;
-    if (PR2.general.final_fsap_free_round)
-        PR2.time.limit *= time_ratio;
+    if (PR2().general.final_fsap_free_round)
+        PR2().time.limit *= time_ratio;
 
-    cout << "Max time for core phase (remaining used in final-round repairs): " << PR2.time.limit << endl;
+    cout << "Max time for core phase (remaining used in final-round repairs): " << PR2().time.limit << endl;
 
     // Adjust the g_time_limit so the epochs are handled properly
-    int epochs_remaining = PR2.epoch.number;
-    double single_time_limit = PR2.time.limit / (double)PR2.epoch.number;
-    PR2.time.limit = single_time_limit;
+    int epochs_remaining = PR2().epoch.number;
+    double single_time_limit = PR2().time.limit / (double)PR2().epoch.number;
+    PR2().time.limit = single_time_limit;
 
-    cout << "Max time for each of the " << epochs_remaining << " epochs: " << PR2.time.limit << endl << endl;
+    cout << "Max time for each of the " << epochs_remaining << " epochs: " << PR2().time.limit << endl << endl;
 
 
 
@@ -89,8 +87,8 @@ bool PR2Wrapper::run_pr2() {
     Simulator *sim = new Simulator(pr2_engine);
 
     cout << "\n\nGenerating an incumbent solution..." << endl;
-    PR2.solution.incumbent = new Solution(sim);
-    PR2.solution.best = PR2.solution.incumbent;
+    PR2().solution.incumbent = new Solution(sim);
+    PR2().solution.best = PR2().solution.incumbent;
 
     /********************************
      * Do the main computation loop *
@@ -99,23 +97,23 @@ bool PR2Wrapper::run_pr2() {
     cout << "\n\nBeginning search for strong cyclic solution..." << endl;
 
     while (find_better_solution(sim)) {
-        if (PR2.logging.verbose)
+        if (PR2().logging.verbose)
             cout << "Finished repair round." << endl;
 
-        if (!PR2.time.time_left()) {
+        if (!PR2().time.time_left()) {
             epochs_remaining--;
             if (epochs_remaining > 0)
-                PR2.time.limit += single_time_limit;
+                PR2().time.limit += single_time_limit;
         }
     }
 
     cout << "Done repairing..." << endl;
 
     // Use the best policy found so far
-    if (PR2.solution.incumbent && PR2.solution.best &&
-        (PR2.solution.best != PR2.solution.incumbent) &&
-        PR2.solution.best->better_than(PR2.solution.incumbent))
-            PR2.solution.incumbent = PR2.solution.best;
+    if (PR2().solution.incumbent && PR2().solution.best &&
+        (PR2().solution.best != PR2().solution.incumbent) &&
+        PR2().solution.best->better_than(PR2().solution.incumbent))
+            PR2().solution.incumbent = PR2().solution.best;
 
 
 
@@ -124,47 +122,47 @@ bool PR2Wrapper::run_pr2() {
      * Do the final FSAP free round *
      ********************************/
 
-    if (PR2.general.final_fsap_free_round)
-        PR2.time.limit /= time_ratio;
+    if (PR2().general.final_fsap_free_round)
+        PR2().time.limit /= time_ratio;
 
-    if (PR2.general.final_fsap_free_round &&
-        !(PR2.solution.incumbent->is_strong_cyclic())) {
+    if (PR2().general.final_fsap_free_round &&
+        !(PR2().solution.incumbent->is_strong_cyclic())) {
 
-        bool os1 = PR2.deadend.enabled;
-        bool os2 = PR2.deadend.generalize;
-        bool os3 = PR2.deadend.record_online;
-        bool os4 = PR2.deadend.force_1safe_weak_plans;
-        bool os5 = PR2.deadend.poison_search;
-        bool os6 = PR2.weaksearch.limit_states;
-        int  os7 = PR2.weaksearch.max_states;
+        bool os1 = PR2().deadend.enabled;
+        bool os2 = PR2().deadend.generalize;
+        bool os3 = PR2().deadend.record_online;
+        bool os4 = PR2().deadend.force_1safe_weak_plans;
+        bool os5 = PR2().deadend.poison_search;
+        bool os6 = PR2().weaksearch.limit_states;
+        int  os7 = PR2().weaksearch.max_states;
 
-        PR2.deadend.enabled = false;
-        PR2.deadend.generalize = false;
-        PR2.deadend.record_online = false;
-        PR2.deadend.force_1safe_weak_plans = false;
-        PR2.deadend.poison_search = false;
-        PR2.weaksearch.limit_states = true;
-        PR2.weaksearch.max_states = 1000;
+        PR2().deadend.enabled = false;
+        PR2().deadend.generalize = false;
+        PR2().deadend.record_online = false;
+        PR2().deadend.force_1safe_weak_plans = false;
+        PR2().deadend.poison_search = false;
+        PR2().weaksearch.limit_states = true;
+        PR2().weaksearch.max_states = 1000;
 
         cout << "\n\nDoing one final best-effort round ignoring FSAPs for unhandled states." << endl;
         find_better_solution(sim);
 
-        PR2.deadend.enabled = os1;
-        PR2.deadend.generalize = os2;
-        PR2.deadend.record_online = os3;
-        PR2.deadend.force_1safe_weak_plans = os4;
-        PR2.deadend.poison_search = os5;
-        PR2.weaksearch.limit_states = os6;
-        PR2.weaksearch.max_states = os7;
+        PR2().deadend.enabled = os1;
+        PR2().deadend.generalize = os2;
+        PR2().deadend.record_online = os3;
+        PR2().deadend.force_1safe_weak_plans = os4;
+        PR2().deadend.poison_search = os5;
+        PR2().weaksearch.limit_states = os6;
+        PR2().weaksearch.max_states = os7;
     }
 
 
     /********************************
      * Optimize things if necessary *
      ********************************/
-    if (PR2.general.optimize_final_solution) {
-        PR2.solution.incumbent->rebuild();
-        PR2.deadend.policy->rebuild();
+    if (PR2().general.optimize_final_solution) {
+        PR2().solution.incumbent->rebuild();
+        PR2().deadend.policy->rebuild();
     }
 
 
@@ -177,15 +175,44 @@ bool PR2Wrapper::run_pr2() {
     cout << "\n\t\t-----------------------------------" << endl;
     cout << "\t\t      { General Statistics }" << endl;
     cout << "\t\t-----------------------------------\n" << endl;
-    cout << "                         Time taken: " << PR2.time.time_taken() << " sec" << endl;
-    cout << "                           # Rounds: " << PR2.logging.fond_search_count << endl;
-    cout << "                    # Weak Searches: " << PR2.weaksearch.num_searches << endl;
-    cout << "                      Solution Size: " << PR2.solution.incumbent->get_size() << endl;
-    cout << "                          FSAP Size: " << PR2.deadend.policy->size() << endl;
-    if (PR2.deadend.combine)
-        cout << "                  Combination Count: " << PR2.deadend.combination_count << endl;
-    if (PR2.deadend.poison_search)
-        cout << "                       Poison Count: " << PR2.deadend.poison_count << endl;
+    cout << "                         Time taken: " << PR2().time.time_taken() << " sec" << endl;
+    cout << "                           # Rounds: " << PR2().logging.fond_search_count << endl;
+    cout << "                    # Weak Searches: " << PR2().weaksearch.num_searches << endl;
+    if (PR2().weaksearch.capped_searches > 0)
+        cout << "               Capped Weak Searches: " << PR2().weaksearch.capped_searches << endl;
+    if (PR2().weaksearch.stop_on_policy)
+        cout << "      Weak Searches Ended on Policy: " << PR2().weaksearch.policy_goals << endl;
+    if (PR2().weaksearch.unreplayed_plans > 0)
+        cout << "         Rejected Weak Search Plans: " << PR2().weaksearch.unreplayed_plans << endl;
+    if (PR2().weaksearch.portfolio) {
+        for (int config = 0; config < (int)PR2().weaksearch.portfolio_wins.size(); config++) {
+            string label = string("Portfolio Wins (") + pr2_search::weak_planner_config_name(config) + ")";
+            cout << string(max(0, 35 - (int)label.size()), ' ') << label << ": " << PR2().weaksearch.portfolio_wins[config] << endl;
+        }
+        cout << "              Portfolio Budget Hits: " << PR2().weaksearch.portfolio_budget_hits << endl;
+    }
+    if (PR2().weaksearch.plan_cache)
+        cout << "            Plan Cache Hits/Lookups: " << PR2().weaksearch.plan_cache_hits << " / " << PR2().weaksearch.plan_cache_lookups << endl;
+    cout << "                      Solution Size: " << PR2().solution.incumbent->get_size() << endl;
+    if (PR2().solution.exact_evaluation && (PR2().solution.incumbent->get_expected_steps() >= 0.0))
+        cout << "             Expected Steps to Goal: " << PR2().solution.incumbent->get_expected_steps() << endl;
+    cout << "                          FSAP Size: " << PR2().deadend.policy->size() << endl;
+    if (PR2().deadend.combine)
+        cout << "                  Combination Count: " << PR2().deadend.combination_count << endl;
+    if (PR2().deadend.poison_search)
+        cout << "                       Poison Count: " << PR2().deadend.poison_count << endl;
+    if (PR2().deadend.subsumption)
+        cout << "                     Subsumed Count: " << PR2().deadend.subsumed_count << endl;
+    if (PR2().deadend.backward_subsumption)
+        cout << "            Backward Subsumed Count: " << PR2().deadend.backward_subsumed_count << endl;
+    if (PR2().deadend.cache_size > 0) {
+        cout << "          Deadend Cache Hits/Misses: " << PR2().deadend.cache_hits << " / " << PR2().deadend.cache_misses << endl;
+        cout << "           Deadend Cache Promotions: " << PR2().deadend.cache_promoted << endl;
+    }
+    if (PR2().solution.sequential_evaluation && (PR2().solution.sequential_comparisons > 0)) {
+        cout << "    Sequential Comparisons (Capped): " << PR2().solution.sequential_comparisons << " (" << PR2().solution.sequential_capped << ")" << endl;
+        cout << "      Trials per Sequential Compare: " << (double(PR2().solution.sequential_trials) / double(PR2().solution.sequential_comparisons)) << endl;
+    }
     cout << "\n-------------------------------------------------------------------\n" << endl;
 
 
@@ -196,9 +223,9 @@ bool PR2Wrapper::run_pr2() {
      **********************/
 
     // Disable the deadend settings for the online simulation(s)
-    PR2.deadend.enabled = false;
-    PR2.deadend.generalize = false;
-    PR2.deadend.record_online = false;
+    PR2().deadend.enabled = false;
+    PR2().deadend.generalize = false;
+    PR2().deadend.record_online = false;
 
     cout << "\nRunning the simulation..." << endl;
     sim->run_trials();
@@ -209,39 +236,39 @@ bool PR2Wrapper::run_pr2() {
     /*******************************
      * Dump the required log files *
      *******************************/
-    if (PR2.output.format == PR2.output.MATCHTREE) {
+    if (PR2().output.format == PR2().output.MATCHTREE) {
 
         cout << "Dumping the policy and fsaps..." << endl;
         ofstream outfile;
 
         outfile.open("policy.out", ios::out);
-        PR2.solution.incumbent->policy->generate_cpp_input(outfile);
+        PR2().solution.incumbent->policy->generate_cpp_input(outfile);
         outfile.close();
 
         outfile.open("policy.fsap", ios::out);
-        PR2.deadend.policy->generate_cpp_input(outfile);
+        PR2().deadend.policy->generate_cpp_input(outfile);
         outfile.close();
 
-    } else if (PR2.output.format == PR2.output.LIST) {
+    } else if (PR2().output.format == PR2().output.LIST) {
 
         cout << "Dumping the policy and fsaps..." << endl;
-        PR2.solution.incumbent->policy->write_policy("policy.out");
-        PR2.deadend.policy->write_policy("policy.fsap", true);
+        PR2().solution.incumbent->policy->write_policy("policy.out");
+        PR2().deadend.policy->write_policy("policy.fsap", true);
 
-    } else if (PR2.output.format == PR2.output.CONTROLLER) {
+    } else if (PR2().output.format == PR2().output.CONTROLLER) {
 
         cout << "Dumping the final psgraph as json..." << endl;
 
         ofstream outfile;
         outfile.open("policy.out", ios::out);
-        PR2.solution.incumbent->network->record_snapshot(outfile, "", false);
+        PR2().solution.incumbent->network->record_snapshot(outfile, "", false);
 
     }
 
 
     cout << endl;
 
-    return PR2.solution.best->is_strong_cyclic();
+    return PR2().solution.best->is_strong_cyclic();
 }
 
 void PR2Wrapper::generate_orig_applicable_ops(const PR2State &curr, vector<OperatorID> &ops) {
@@ -249,78 +276,110 @@ void PR2Wrapper::generate_orig_applicable_ops(const PR2State &curr, vector<Opera
 }
 
 void PR2Wrapper::generate_fsap_aware_applicable_ops(const PR2State &curr, vector<OperatorID> &ops) {
-    // pr2_engine->get_deadend_aware_successor_generator()->generate_applicable_ops(curr, ops);
-    // struct DeadendAwareSuccessorGenerator {
-    //     void generate_applicable_ops(const PR2State &curr, vector<OperatorID> &ops) const;
-    // };
-    DeadendAwareSuccessorGenerator().generate_applicable_ops(curr, ops);
+    pr2_engine->get_deadend_aware_successor_generator()->generate_applicable_ops(curr, ops);
 }
 
-PR2Wrapper PR2; // Holds all of the settings and data for PR2
+PR2Task::~PR2Task() {
+    delete regressable_ops;
+    delete regressable_cond_ops;
+}
 
-void PR2Wrapper::generate_nondet_operator_mappings() {
-    // Map from operator id to nondet index
-    vector<int>* nondet_index_map = new vector<int>(PR2.proxy->get_operators().size());
+PR2Wrapper::PR2Wrapper() : rng(724227515), task(make_shared<PR2Task>()) {}
 
-    // assert that the mappings are empty
-    assert(PR2.general.nondet_mapping.empty());
-    assert(PR2.general.nondet_outcome_mapping.empty());
+PR2Wrapper::~PR2Wrapper() {
+    for (auto state : deadend.promoted)
+        delete state;
+}
 
-    // temporary mapping from non-det name to index
-    map<string, int> nondet_name_to_index;
+static PR2Wrapper default_context;
+thread_local constinit PR2Wrapper *pr2_context = &default_context;
+
+// Builds the task data for this context, unless it shares an already
+//  initialized task with an earlier solve. The new task is installed
+//  before it is filled in, since building the policies reads it through
+//  PR2(), but only building_task can write to it, and that is dropped
+//  once the task is done.
+void PR2Wrapper::initialize_task() {
+
+    if (PR2().task->initialized) {
+        // The task only has the regressable operators if the solve that
+        //  built it had deadends enabled
+        assert(!PR2().deadend.enabled || PR2().task->regressable_ops);
+        return;
+    }
 
-    int current_nondet_index = 0;
-    
-    for (auto op : PR2.proxy->get_operators()) {
-        //If not in the mapping yet
-        if (nondet_name_to_index.find(op.get_nondet_name()) == nondet_name_to_index.end()) {
-            nondet_name_to_index[op.get_nondet_name()] = current_nondet_index;
-            PR2.general.nondet_mapping.push_back(vector<int>());
-            current_nondet_index++;
+    if (!PR2().building_task) {
+        PR2().building_task = make_shared<PR2Task>();
+        PR2().task = PR2().building_task;
+    }
+    PR2Task &building = *(PR2().building_task);
 
+    building.num_vars = PR2().proxy->get_variables().size();
 
+    // Lay out the packed representation used by every PR2State (unless
+    //  the initial state already did)
+    vector<int> domain_sizes;
+    for (auto var : PR2().proxy->get_variables())
+        domain_sizes.push_back(var.get_domain_size());
+    if (!building.packer.is_initialized())
+        building.packer.initialize(domain_sizes);
 
-            PR2.general.conditional_mask.push_back(new vector<int>());
-            PR2.deadend.nondetop2fsaps.push_back(new vector< FSAP* >());
-        }
-        PR2.general.nondet_mapping[nondet_name_to_index[op.get_nondet_name()]].push_back(op.get_id());
-        // outcome id comes from action name after _DETDUP_. The "8" is length of "_DETDUP_"
-        //Some elements don't have detdup, they have an assignment of 1
-        if (op.get_name().find("_detdup_") == std::string::npos){
-            PR2.general.nondet_outcome_mapping[op.get_id()] = 1;
-        } else {
-            PR2.general.nondet_outcome_mapping[op.get_id()] = 
-                stoi(op.get_name().substr(op.get_name().find("_detdup_") + 8).substr(0, 1));
-        }
-        op.nondet_index = nondet_name_to_index[op.get_nondet_name()];
-        op.nondet_outcome = PR2.general.nondet_outcome_mapping[op.get_id()];
-        (*nondet_index_map)[op.get_id()] = op.nondet_index;
+#ifndef NDEBUG
+    PR2State::check_packing(domain_sizes);
+#endif
 
-        for (auto eff : op.get_all_effects()) {
-            for (auto cond : eff.get_conditions()) {
-                vector<int> *var_list = PR2.general.conditional_mask[op.nondet_index];
-                if (find(var_list->begin(), var_list->end(), cond.get_variable().get_id()) == var_list->end())
-                    PR2.general.conditional_mask[op.nondet_index]->push_back(cond.get_variable().get_id());
-            }
-        }
+    building.actions.build(*(PR2().proxy));
+
+    building.goal_op = PR2().proxy->get_goal_operator();
+
+    for (auto x : PR2().proxy->get_goals()) {
+        building.original_goal.push_back(pair<int, int>(x.get_variable().get_id(), x.get_value()));
+    }
+
+    if (PR2().deadend.enabled)
+        generate_regressable_ops(building);
+
+    building.initialized = true;
+    PR2().building_task.reset();
+}
+
+// The initial state is built along with the proxy, before run_pr2 sets
+//  up the task, so it may need the packed layout first
+void PR2Wrapper::initialize_layout(const State &state) {
+
+    assert(!PR2().task->initialized);
+
+    if (!PR2().building_task) {
+        PR2().building_task = make_shared<PR2Task>();
+        PR2().task = PR2().building_task;
     }
 
-    PR2.proxy->set_nondet_index_map(*nondet_index_map);
+    vector<int> domain_sizes;
+    for (unsigned i = 0; i < state.size(); i++)
+        domain_sizes.push_back(state[i].get_variable().get_domain_size());
+    PR2().building_task->packer.initialize(domain_sizes);
+}
+
+void PR2Wrapper::generate_nondet_operator_mappings() {
+
+    // assert that this context has no mappings yet
+    assert(PR2().deadend.nondetop2fsaps.empty());
 
-    //TODO
-    //Reinstantiate conditional mask and possibly nondetop2fspas
-    //They were previously global and not instantiated anywhere
+    PR2().proxy->set_nondet_index_map(PR2().task->actions.op_nondet_index);
+
+    for (int i = 0; i < PR2().task->actions.num_nondet_actions(); i++)
+        PR2().deadend.nondetop2fsaps.push_back(new vector< FSAP* >());
 
 
     // /* Build the data structures required for mapping between the
     //  * deterministic actions and their non-deterministic equivalents. */
     // int cur_nondet = 0;
-    // for (auto op : PR2.proxy->get_operators()) {
+    // for (auto op : PR2().proxy->get_operators()) {
 
     //     int nondet_index = -1;
 
-    //     PR2.general.conditional_mask.push_back(new vector<int>());
-    //     PR2.deadend.nondetop2fsaps.push_back(new vector< FSAP* >());
+    //     PR2().general.conditional_mask.push_back(new vector<int>());
+    //     PR2().deadend.nondetop2fsaps.push_back(new vector< FSAP* >());
 
     //     if (PRP.general.nondet_index_mapping.find(op.get_nondet_name()) == PRP.general.nondet_index_mapping.end()) {
 
@@ -352,8 +411,76 @@ void PR2Wrapper::generate_nondet_operator_mappings() {
     // }
 }
 
+void PR2ActionModel::build(const PR2TaskProxy &proxy) {
+
+    int num_ops = proxy.get_operators().size();
+    op_nondet_index.assign(num_ops, -1);
+    op_nondet_outcome.assign(num_ops, -1);
+
+    // temporary mapping from non-det name to index
+    map<string, int> nondet_name_to_index;
+    vector< vector<int> > nondet_mapping;
+    vector< vector<int> > conditional_mask;
+
+    op_pre_begin.push_back(0);
+    op_eff_begin.push_back(0);
+
+    for (auto op : proxy.get_operators()) {
+        //If not in the mapping yet
+        if (nondet_name_to_index.find(op.get_nondet_name()) == nondet_name_to_index.end()) {
+            nondet_name_to_index[op.get_nondet_name()] = nondet_mapping.size();
+            nondet_mapping.push_back(vector<int>());
+            conditional_mask.push_back(vector<int>());
+        }
+        int nondet_index = nondet_name_to_index[op.get_nondet_name()];
+        nondet_mapping[nondet_index].push_back(op.get_id());
+        op_nondet_index[op.get_id()] = nondet_index;
+
+        // outcome id comes from action name after _DETDUP_. The "8" is length of "_DETDUP_"
+        //Some elements don't have detdup, they have an assignment of 1
+        if (op.get_name().find("_detdup_") == std::string::npos){
+            op_nondet_outcome[op.get_id()] = 1;
+        } else {
+            op_nondet_outcome[op.get_id()] =
+                stoi(op.get_name().substr(op.get_name().find("_detdup_") + 8).substr(0, 1));
+        }
+
+        // Operators are visited in id order, so the offsets line up
+        assert((int)op_pre_begin.size() == op.get_id() + 1);
+
+        for (auto pre : op.get_preconditions())
+            preconditions.push_back(pre.get_pair());
+        op_pre_begin.push_back(preconditions.size());
+
+        for (auto eff : op.get_all_effects()) {
+            int cond_begin = effect_conditions.size();
+            for (auto cond : eff.get_conditions()) {
+                effect_conditions.push_back(cond.get_pair());
+                vector<int> &var_list = conditional_mask[nondet_index];
+                if (find(var_list.begin(), var_list.end(), cond.get_variable().get_id()) == var_list.end())
+                    var_list.push_back(cond.get_variable().get_id());
+            }
+            effects.push_back({eff.get_fact().get_variable().get_id(),
+                               eff.get_fact().get_value(),
+                               cond_begin,
+                               (int)effect_conditions.size()});
+        }
+        op_eff_begin.push_back(effects.size());
+    }
+
+    // Flatten the per-action lists
+    outcome_begin.push_back(0);
+    mask_begin.push_back(0);
+    for (unsigned i = 0; i < nondet_mapping.size(); i++) {
+        outcome_ops.insert(outcome_ops.end(), nondet_mapping[i].begin(), nondet_mapping[i].end());
+        outcome_begin.push_back(outcome_ops.size());
+        mask_vars.insert(mask_vars.end(), conditional_mask[i].begin(), conditional_mask[i].end());
+        mask_begin.push_back(mask_vars.size());
+    }
+}
+
 void PR2OperatorProxy::update_nondet_info() {
-    nondet_index = PR2.proxy->get_nondet_index(_index);
-    nondet_outcome = PR2.general.nondet_outcome_mapping[_index];
+    nondet_index = PR2().task->actions.get_nondet_index(_index);
+    nondet_outcome = PR2().task->actions.get_nondet_outcome(_index);
 }
 
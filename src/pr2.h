@@ -2,12 +2,16 @@
 #define PR2_H
 
 #include <map>
+#include <memory>
 #include <queue>
 #include <set>
 #include <iostream>
 #include <sstream>
+#include <thread>
 #include <vector>
 
+#include "fd_integration/action_model.h"
+#include "fd_integration/partial_state.h"
 #include "fd_integration/pr2_proxies.h"
 #include "fd_integration/pr2_search_algorithm.h"
 #include "fd_integration/fsap_penalized_ff_heuristic.h"
@@ -15,6 +19,8 @@
 using namespace std;
 
 struct DeadendTuple;
+struct DeadendCheckCache;
+struct ForbiddenOpsCache;
 struct FSAP;
 struct PR2SearchNode;
 struct PR2SearchStatus;
@@ -28,12 +34,40 @@ class pr2_node_comparison;
 
 class PR2TaskProxy;
 class PR2OperatorProxy;
+class RelaxedReachability;
 class SearchAlgorithm;
 
 namespace pr2_search {
     class PR2Search;
 }
 
+/*******************************************************************
+ * Task data. Everything here is computed once from the FD task when
+ * the first solve starts (see PR2Wrapper::initialize_task) and is
+ * only read afterwards, so several PR2Wrapper contexts can share it.
+ * The contexts only get a const view of it (PR2Wrapper::task), and
+ * the policies in here are only ever queried through their const
+ * methods. Anything a search changes belongs in the PR2Wrapper.
+ *******************************************************************/
+struct PR2Task {
+
+    bool initialized = false; // Set once initialize_task has filled in the fields below
+
+    unsigned int num_vars = 0; // The number of variables in the problem
+    PR2StatePacker packer; // Packed layout of every PR2State of this task
+    PR2ActionModel actions; // Flat operator tables: nondet action -> ground operator ids (outcomes), operator -> outcome, conditional masks, etc.
+    const Policy *regressable_ops = nullptr; // The policy to check what operators are regressable (only built with deadends enabled)
+    const Policy *regressable_cond_ops = nullptr; // The policy to check what operators with conditional effects are regressable
+    PR2OperatorProxy * goal_op = nullptr; // The operator that we use to achieve the goal
+    vector<pair<int, int>> original_goal; // The original goal that we can use for resetting the search
+
+    PR2Task() = default;
+    ~PR2Task();
+
+    PR2Task(const PR2Task &) = delete;
+    PR2Task &operator=(const PR2Task &) = delete;
+};
+
 // General struct for PR2 settings and data structures
 struct PR2Wrapper {
 
@@ -45,10 +79,22 @@ struct PR2Wrapper {
     utils::RandomNumberGenerator rng;
     // = utils::RandomNumberGenerator(724227515);
 
-    // Meta-level task that houses all the FD details
+    // Data computed from the task, possibly shared with other contexts
+    shared_ptr<const PR2Task> task;
+    shared_ptr<PR2Task> building_task; // The task while this context fills it in (null otherwise)
+    void initialize_task();
+    void initialize_layout(const State &state); // Lays out the packed states, if a state is needed before run_pr2
+
+    // Meta-level task that houses all the FD details. This is per
+    //  context, since the weak searches change its goal and initial state.
     PR2TaskProxy *proxy = nullptr;
 
-    PR2Wrapper() : rng(724227515) {}
+    PR2Wrapper();
+    ~PR2Wrapper();
+
+    // The context owns its caches, so it cannot be copied
+    PR2Wrapper(const PR2Wrapper &) = delete;
+    PR2Wrapper &operator=(const PR2Wrapper &) = delete;
 
     // The single search algorithm used by PR2
     shared_ptr<pr2_search::PR2Search> pr2_engine;
@@ -76,11 +122,19 @@ struct PR2Wrapper {
 
         // Settings
         int evaluation_trials = 1000; // Number of trials to do when evaluating a policy's score
+        bool exact_evaluation = false; // Compute a policy's score from its step graph when possible (instead of simulating)
+        bool sequential_evaluation = true; // Compare policies with batches of trials until the comparison is decided
+        int sequential_batch = 50; // Number of trials added to a policy for every round of a sequential comparison
+        double sequential_confidence = 0.95; // Confidence needed to decide a sequential comparison
+        int sequential_max_trials = 1000; // Most trials a policy gets in a sequential comparison
 
         // Data structures used globally for the solutions
         Solution *incumbent; // The current solution we are building
         Solution *best; // The best solution we've found so far
         int num_steps_created = 0; // Used to give each step a unique id
+        int sequential_comparisons = 0; // Number of sequential comparisons that needed trials
+        long long sequential_trials = 0; // Number of trials run by those comparisons
+        int sequential_capped = 0; // Number of those comparisons left undecided at the trial cap
 
     } solution;
 
@@ -116,6 +170,11 @@ struct PR2Wrapper {
         bool regress_trigger_only = false; // If true, the only FSAP for a new deadend should be from the action that lead there
         bool force_1safe_weak_plans = true; // If true, a weak plan is only used if no 1-off reachable state is a deadend
         bool poison_search = true; // If true, deadends will disable certain aspects of the full search tree
+        bool subsumption = true; // If true, new FSAPs / deadends are dropped when a more general one already exists
+        bool backward_subsumption = false; // If true, existing FSAPs / deadends made redundant by a new one are deactivated
+        int cache_size = 100000; // Maximum number of states to remember deadend checks for (0 disables the cache)
+        bool cache_promote = true; // If true, states found to be deadends are added to the deadend policy
+        bool fast_reachability = true; // If true, deadends are detected with a bitset reachability check rather than h^add
 
         // Data structures
         fsap_penalized_ff_heuristic::FSAPPenalizedFFHeuristic *reachability_heuristic; // A custom heuristic for detecting deadends
@@ -124,8 +183,18 @@ struct PR2Wrapper {
         Policy *online_policy; // Temporary store for deadends found online
         vector< DeadendTuple* > found_online; // Stores the deadends that we detect online (along with the necessary context)
         vector< vector< FSAP* > * > nondetop2fsaps; // Maps a nondet operator id to the set of FSAPs that forbid it from occurring
+        vector< PR2State* > promoted; // Deadends found by is_deadend that wait for the next update_deadends (owned until then)
+        int fsap_version = 0; // Bumped whenever nondetop2fsaps changes (lets the heuristic keep its FSAP index up to date)
+        unique_ptr<RelaxedReachability> reachability; // Built the first time a fast deadend check is needed
+        unique_ptr<DeadendCheckCache> check_cache; // Results of the recent deadend checks (see is_deadend)
+        unique_ptr<ForbiddenOpsCache> forbidden_ops_cache; // Results of the deadend aware successor generator for recent states
         int combination_count = 0; // Keeps track of how many times we combined FSAPs to produce a new deadend
         int poison_count = 0; // Keeps track of how many search nodes we've poisoned
+        int subsumed_count = 0; // Number of new FSAPs / deadends dropped because they were subsumed
+        int backward_subsumed_count = 0; // Number of existing FSAPs / deadends deactivated by more general ones
+        int cache_hits = 0; // Deadend checks answered by the cache
+        int cache_misses = 0; // Deadend checks that needed the reachability heuristic
+        int cache_promoted = 0; // Deadends found by the check that were queued for the deadend policy
 
     } deadend;
 
@@ -158,6 +227,20 @@ struct PR2Wrapper {
         bool limit_states = false; // Forces the search to stop based on the max_states setting
         int max_states = 100; // The number of states that we should limit the search to
         int num_searches = 0; // Number of times we call for a new plan
+        int capped_searches = 0; // Number of weak searches cut off at max_states
+        int policy_goals = 0; // Number of weak searches whose goal moved to the policy (with stop_on_policy)
+        int unreplayed_plans = 0; // Plans from the weak search that follow_plan rejected
+
+        // Portfolio of weak planners
+        bool portfolio = false; // Race the weak planner configurations with a limited budget before searching in full
+        int portfolio_budget = 1000; // Expansions each configuration gets in the portfolio
+        vector<int> portfolio_wins; // Plans found by each configuration (filled in on the first portfolio search)
+        int portfolio_budget_hits = 0; // Portfolio runs cut off at portfolio_budget (not counted in capped_searches)
+
+        // Plan cache
+        bool plan_cache = true; // Reuse a plan from an earlier round when it still works, rather than searching
+        int plan_cache_lookups = 0;
+        int plan_cache_hits = 0;
 
     } weaksearch;
 
@@ -208,9 +291,6 @@ struct PR2Wrapper {
         bool limited = true; // Restrict the localized planning to a small number of states
         int max_states = 100; // The number of states to restrict ourselves to if limited is true
 
-        // Data structures
-        vector<pair<int, int>> original_goal; // The original goal that we can use for resetting the search
-
     } localize;
 
 
@@ -296,21 +376,11 @@ struct PR2Wrapper {
         // General settings
         bool final_fsap_free_round = true; // Do a final best-effort round
         bool optimize_final_solution = true; // Rebuild the final solution to throw away irrelevant parts
-
-        // General stats
-        unsigned int num_vars = 0; // The number of variables in the problem
+        int num_threads = max(1, (int)std::thread::hardware_concurrency()); // Threads available to the parallel phases (e.g., building policies)
 
         // General data structures
-        vector< vector<int> > nondet_mapping; // Maps a non-deterministic action id to a list of ground operator ids
-        map<int, int> nondet_outcome_mapping; // Maps an action id to the outcome of the non-deterministic action
-
-        vector<vector<int> *> conditional_mask; // Maps a non-deterministic action id to the variables that must be defined when doing context-sensitive regression
-        Policy *regressable_ops; // The policy to check what operators are regressable
-        Policy *regressable_cond_ops; // The policy to check what operators with conditional effects are regressable
         SolutionStep * matched_step; // Contains the condition that matched when our policy recognized the state
 
-        PR2OperatorProxy * goal_op; // The operator that we use to achieve the goal
-
     } general;
 
     /************************************************************
@@ -326,6 +396,16 @@ struct PR2Wrapper {
 
             if (args[i].compare("--solution-evaluation-trials") == 0)
                 solution.evaluation_trials = stoi(args[++i]);
+            else if (args[i].compare("--solution-exact-evaluation") == 0)
+                solution.exact_evaluation = (1 == stoi(args[++i]));
+            else if (args[i].compare("--solution-sequential-evaluation") == 0)
+                solution.sequential_evaluation = (1 == stoi(args[++i]));
+            else if (args[i].compare("--solution-sequential-batch") == 0)
+                solution.sequential_batch = stoi(args[++i]);
+            else if (args[i].compare("--solution-sequential-confidence") == 0)
+                solution.sequential_confidence = stod(args[++i]);
+            else if (args[i].compare("--solution-sequential-max-trials") == 0)
+                solution.sequential_max_trials = stoi(args[++i]);
 
             /**************************************************************/
 
@@ -365,6 +445,21 @@ struct PR2Wrapper {
             else if (args[i].compare("--deadend-poison-search") == 0)
                 deadend.poison_search = (1 == stoi(args[++i]));
 
+            else if (args[i].compare("--deadend-subsumption") == 0)
+                deadend.subsumption = (1 == stoi(args[++i]));
+
+            else if (args[i].compare("--deadend-backward-subsumption") == 0)
+                deadend.backward_subsumption = (1 == stoi(args[++i]));
+
+            else if (args[i].compare("--deadend-cache-size") == 0)
+                deadend.cache_size = stoi(args[++i]);
+
+            else if (args[i].compare("--deadend-cache-promote") == 0)
+                deadend.cache_promote = (1 == stoi(args[++i]));
+
+            else if (args[i].compare("--deadend-fast-reachability") == 0)
+                deadend.fast_reachability = (1 == stoi(args[++i]));
+
             /**************************************************************/
 
             else if (args[i].compare("--epoch") == 0)
@@ -381,6 +476,15 @@ struct PR2Wrapper {
             else if (args[i].compare("--weaksearch-fsap-penalty") == 0)
                 weaksearch.fsap_penalty = stoi(args[++i]);
 
+            else if (args[i].compare("--weaksearch-plan-cache") == 0)
+                weaksearch.plan_cache = (1 == stoi(args[++i]));
+
+            else if (args[i].compare("--weaksearch-portfolio") == 0)
+                weaksearch.portfolio = (1 == stoi(args[++i]));
+
+            else if (args[i].compare("--weaksearch-portfolio-budget") == 0)
+                weaksearch.portfolio_budget = stoi(args[++i]);
+
             /**************************************************************/
 
             else if (args[i].compare("--output-format") == 0)
@@ -489,6 +593,9 @@ struct PR2Wrapper {
             else if (args[i].compare("--optimize-final-solution") == 0)
                 general.optimize_final_solution = (1 == stoi(args[++i]));
 
+            else if (args[i].compare("--num-threads") == 0)
+                general.num_threads = max(1, stoi(args[++i]));
+
             /**************************************************************/
 
             else
@@ -504,6 +611,17 @@ struct PR2Wrapper {
         + "\n"
         + "\t --solution-evaluation-trials NUM_TRIALS (default=" + to_string(solution.evaluation_trials) + ")\n"
         + "\t\t Number of monte-carlo trials used to evaluate the quality of a policy.\n\n"
+        + "\t --solution-exact-evaluation 1/0 (default=" + to_string(solution.exact_evaluation) + ")\n"
+        + "\t\t Compute the exact chance of reaching the goal (and the expected steps) from the policy's steps, with no depth limit.\n"
+        + "\t\t Falls back to the trials if need be.\n\n"
+        + "\t --solution-sequential-evaluation 1/0 (default=" + to_string(solution.sequential_evaluation) + ")\n"
+        + "\t\t Compare policies by adding batches of trials until one is better with the given confidence.\n\n"
+        + "\t --solution-sequential-batch NUM_TRIALS (default=" + to_string(solution.sequential_batch) + ")\n"
+        + "\t\t Number of trials added to each policy per round of a sequential comparison.\n\n"
+        + "\t --solution-sequential-confidence CONFIDENCE (default=" + to_string(solution.sequential_confidence) + ")\n"
+        + "\t\t Confidence (between 0 and 1) needed to decide a sequential comparison.\n\n"
+        + "\t --solution-sequential-max-trials NUM_TRIALS (default=" + to_string(solution.sequential_max_trials) + ")\n"
+        + "\t\t Most trials a policy gets before a sequential comparison falls back to the scores so far.\n\n"
         + "\n\n"
         + "\t --time-limit TIME_LIMIT (default=" + to_string(int(time.limit)) + ")\n"
         + "\t\t Only search for the given time. This will be cut in half if --final-fsap-free-round is used.\n\n"
@@ -522,6 +640,16 @@ struct PR2Wrapper {
         + "\t\t Keep computing weak plans until we have one that doesn't reach a deadend in one step.\n\n"
         + "\t --deadend-poison-search 1/0 (default=" + to_string(deadend.poison_search) + ")\n"
         + "\t\t Prune parts of the search space if they would no longer be reached in the same way because of a found deadend / FSAP.\n\n"
+        + "\t --deadend-subsumption 1/0 (default=" + to_string(deadend.subsumption) + ")\n"
+        + "\t\t Skip new FSAPs and deadends that are covered by a more general one that was already found.\n\n"
+        + "\t --deadend-backward-subsumption 1/0 (default=" + to_string(deadend.backward_subsumption) + ")\n"
+        + "\t\t Deactivate existing FSAPs and deadends when a new, more general one is found.\n\n"
+        + "\t --deadend-cache-size SIZE (default=" + to_string(deadend.cache_size) + ")\n"
+        + "\t\t Number of states to remember the deadend check for (0 disables the cache).\n\n"
+        + "\t --deadend-cache-promote 1/0 (default=" + to_string(deadend.cache_promote) + ")\n"
+        + "\t\t Add the states found to be deadends to the deadend policy.\n\n"
+        + "\t --deadend-fast-reachability 1/0 (default=" + to_string(deadend.fast_reachability) + ")\n"
+        + "\t\t Detect deadends with a plain relaxed reachability fixpoint instead of the h^add computation.\n\n"
         + "\n\n"
         + "\t --epoch EPOCH_COUNT (default=" + to_string(epoch.number) + ")\n"
         + "\t\t Minimum number of times to execute the outer search loop for a policy. Useful if deadends are present and a single pass takes too long.\n\n"
@@ -532,6 +660,12 @@ struct PR2Wrapper {
         + "\t\t Penalize the FSAP actions in the heuristic computation by a constant amount..\n\n"
         + "\t --weaksearch-fsap-penalty PENALTY (default=" + to_string(weaksearch.fsap_penalty) + ")\n"
         + "\t\t The constant to use for penalizing FSAP actions in the heuristic computation.\n\n"
+        + "\t --weaksearch-plan-cache 1/0 (default=" + to_string(weaksearch.plan_cache) + ")\n"
+        + "\t\t Reuse a previously found plan when it still reaches the goal from the current state.\n\n"
+        + "\t --weaksearch-portfolio 1/0 (default=" + to_string(weaksearch.portfolio) + ")\n"
+        + "\t\t Race the weak planner configurations with a limited budget each (the first 1-safe plan wins), before a full search with the most successful one.\n\n"
+        + "\t --weaksearch-portfolio-budget EXPANSIONS (default=" + to_string(weaksearch.portfolio_budget) + ")\n"
+        + "\t\t Number of expansions each configuration gets in the portfolio.\n\n"
         + "\n\n"
         + "\t --output-format 1/2/3 (default=" + to_string(output.format) + ")\n"
         + "\t\t Dump the policy to the file policy.out.\n"
@@ -603,11 +737,37 @@ struct PR2Wrapper {
         + "\t\t Do one final meta search round with the best solution found (closing every leaf possible)..\n\n"
         + "\t --optimize-final-solution 0/1 (default=" + to_string(general.optimize_final_solution) + ")\n"
         + "\t\t Do a final simulation and throw out any solution step (or FSAP) not used..\n\n"
+        + "\t --num-threads THREADS (default=" + to_string(general.num_threads) + ")\n"
+        + "\t\t Number of threads to use for the parallel phases (e.g., building the policies).\n\n"
         + "\n"
         + "\n\n\t\tSee http://www.haz.ca/research/pr2 for details.\n\n\n";
     }
 };
 
-extern PR2Wrapper PR2; // Holds all of the settings and data for PR2
+/*******************************************************************
+ * Planner context. Everything PR2 knows about a solve (settings,
+ * solutions, deadends, RNG and statistics) lives in a PR2Wrapper,
+ * next to a shared PR2Task, and the code reaches it through PR2(),
+ * which returns the context bound to the calling thread. Every thread
+ * starts out on the default context, so independent solves in one
+ * process each bind their own PR2Wrapper, and worker threads have to
+ * bind their caller's context (see PR2ContextBinding) before calling
+ * PR2(). The packed state layout is part of the task, so states can
+ * only be used with contexts that share it.
+ *******************************************************************/
+extern thread_local constinit PR2Wrapper *pr2_context;
+
+// Holds all of the settings and data for PR2
+inline PR2Wrapper &PR2() { return *pr2_context; }
+
+struct PR2ContextBinding {
+    PR2Wrapper *previous;
+
+    explicit PR2ContextBinding(PR2Wrapper &context) : previous(pr2_context) { pr2_context = &context; }
+    ~PR2ContextBinding() { pr2_context = previous; }
+
+    PR2ContextBinding(const PR2ContextBinding &) = delete;
+    PR2ContextBinding &operator=(const PR2ContextBinding &) = delete;
+};
 
 #endif
@@ -23,14 +23,14 @@ string RegressableOperator::get_name() {
     return op.get_name();
 }
 
-void generate_regressable_ops() {
+void generate_regressable_ops(PR2Task &task) {
 
     list<PolicyItem *> reg_steps;
     list<PolicyItem *> cond_reg_steps;
 
     PR2State *s;
-    for (const auto & op : PR2.proxy->get_operators()) {
-        if (0 == PR2.general.conditional_mask[op.nondet_index]->size()) {
+    for (const auto & op : PR2().proxy->get_operators()) {
+        if (PR2().task->actions.get_conditional_mask(op.nondet_index).empty()) {
             s = new PR2State();
 
             // Only applicable if the effects currently hold.
@@ -111,9 +111,12 @@ void generate_regressable_ops() {
         }
     }
 
-    PR2.general.regressable_ops = new Policy();
-    PR2.general.regressable_ops->update_policy(reg_steps);
-    PR2.general.regressable_cond_ops = new Policy();
-    PR2.general.regressable_cond_ops->update_policy(cond_reg_steps);
+    Policy *regressable_ops = new Policy();
+    regressable_ops->update_policy(reg_steps);
+    task.regressable_ops = regressable_ops;
+
+    Policy *regressable_cond_ops = new Policy();
+    regressable_cond_ops->update_policy(cond_reg_steps);
+    task.regressable_cond_ops = regressable_cond_ops;
 
 }
@@ -22,6 +22,6 @@ struct RegressableOperator : PolicyItem {
     virtual void dump() const;
 };
 
-void generate_regressable_ops();
+void generate_regressable_ops(PR2Task &task); // Fills in the task's regressable operator policies
 
 #endif
@@ -8,39 +8,195 @@
 #include "deadend.h"
 
 Simulator::Simulator(shared_ptr<pr2_search::PR2Search> eng) : engine(eng) {
-    current_state = PR2.proxy->generate_new_init();
+    current_state = PR2().proxy->generate_new_init();
+    for (auto goal_tuple : PR2().task->original_goal)
+        original_goal[goal_tuple.first] = goal_tuple.second;
+    active_goal = &original_goal;
 }
 
-void Simulator::setup_simulation(PR2State * init) {
-    if (init)
-        current_state = new PR2State(*init);
-    else
-        current_state = PR2.proxy->generate_new_init();
+void CachedPlan::dump() const {
+    cout << "Cached plan:" << endl;
+    cout << " -{ Precondition }-" << endl;
+    state->dump_pddl();
+    cout << " -{ Plan }-" << endl;
+    for (auto op : plan)
+        cout << PR2().proxy->get_operators()[op].get_name() << endl;
+    cout << "" << endl;
 }
 
-const PR2OperatorProxy Simulator::pick_action(SolutionStep *step, int index) {
+int Simulator::pick_action(SolutionStep *step, int index) {
+    auto outcomes = PR2().task->actions.get_outcomes(step->op.nondet_index);
     if (-1 == index)
-        index = PR2.rng.random(PR2.general.nondet_mapping[step->op.nondet_index].size());
-    int op_ind = PR2.general.nondet_mapping[step->op.nondet_index][index];
-    return PR2.proxy->get_operators()[op_ind];
+        index = PR2().rng.random(outcomes.size());
+    return outcomes[index];
 }
 
 void Simulator::reset_goal() {
-    PR2.proxy->set_goal(PR2.localize.original_goal);
+    PR2().proxy->set_goal(PR2().task->original_goal);
+    active_goal = &original_goal;
 }
 
 // Adjust the goal if we are planning locally
 void Simulator::set_local_goal() {
-    if (PR2.localize.enabled) {
-        PR2.proxy->set_goal(*current_goal);
+    if (PR2().localize.enabled) {
+        PR2().proxy->set_goal(*current_goal);
+        active_goal = current_goal;
     }
 }
 
+// Replays the plan from the current state, checking that every operator
+//  is applicable and not forbidden. With stop_on_policy, the plan is cut
+//  off at the first state that the goal step or a strong cyclic step of
+//  the incumbent handles, since the policy takes over from there.
+//  Otherwise the plan has to reach the goal. Either way, matched is the
+//  step that the incumbent uses in the state the plan ends in (this is
+//  where incorporate_plan regresses from), and the plan is rejected if
+//  there is no such step.
+bool Simulator::follow_plan(DeterministicPlan &p, SolutionStep *&matched) {
+
+    PR2State *curr = &trial_state;
+    PR2State *next = &trial_next;
+    *curr = *current_state;
+    matched = nullptr;
+
+    for (unsigned i = 0; i < p.size(); i++) {
+
+        int op = p[i].get_index();
+        for (const FactPair &pre : PR2().task->actions.get_preconditions(op))
+            if ((*curr)[pre.var] != pre.value)
+                return false;
+        if (is_forbidden(*curr, PR2().task->actions.get_nondet_index(op)))
+            return false;
+        curr->progress(op, *next);
+        swap(curr, next);
+
+        if (PR2().weaksearch.stop_on_policy && PR2().solution.incumbent) {
+            SolutionStep *step = PR2().solution.incumbent->get_step(*curr);
+            if (step && (step->is_goal || step->is_sc)) {
+                p.erase(p.begin() + i + 1, p.end());
+                matched = step;
+                return true;
+            }
+        }
+    }
+
+    if (!curr->entails(*active_goal) || !PR2().solution.incumbent)
+        return false;
+
+    matched = PR2().solution.incumbent->get_step(*curr);
+    return nullptr != matched;
+}
+
+// Looks for a cached plan (the shortest one that still works) to use
+//  instead of running the weak search
+bool Simulator::find_cached_plan() {
+
+    PR2().weaksearch.plan_cache_lookups++;
+
+    cache_hit = nullptr;
+    SolutionStep *hit_step = nullptr;
+    plan_cache.visit_entailed_items<CachedPlan>(*current_state, [this, &hit_step](CachedPlan *cached) {
+        if (!cached->is_active || !(cached->goal == *active_goal) ||
+            (cache_hit && (cached->plan.size() >= plan.size())))
+                return true;
+        DeterministicPlan candidate = cached->plan;
+        SolutionStep *matched;
+        if (follow_plan(candidate, matched)) {
+            cache_hit = cached;
+            hit_step = matched;
+            plan = candidate;
+        }
+        return true;
+    });
+
+    if (!cache_hit)
+        return false;
+
+    PR2().weaksearch.plan_cache_hits++;
+    PR2().general.matched_step = hit_step;
+    plan_found = true;
+    return true;
+}
+
+// Takes a plan from the weak search. Replaying it drops the part the
+//  policy already handles, and finds the step it ends in -- with a local
+//  goal, the search stops at the expected step's state, which the
+//  incumbent may handle with a different step. If there is no such step,
+//  the plan can't be incorporated, and is rejected.
+bool Simulator::take_plan(const DeterministicPlan &p) {
+
+    plan = p;
+
+    SolutionStep *matched;
+    if (!follow_plan(plan, matched)) {
+        PR2().weaksearch.unreplayed_plans++;
+        if (PR2().logging.verbose)
+            cout << "Rejecting a plan the incumbent can't pick up from." << endl;
+        return false;
+    }
+
+    PR2().general.matched_step = matched;
+    return true;
+}
+
+// Runs the weak planner. In portfolio mode, the configurations are raced
+//  with a limited number of expansions each, and the first plan that
+//  passes check_1safe wins. If none does, the configuration with the most
+//  wins so far (the first in the order) gets a full search, without the
+//  budget, so that the portfolio never fails where the plain weak search
+//  would have succeeded. That plan is checked by replan as usual.
+void Simulator::run_weak_search() {
+
+    if (!PR2().weaksearch.portfolio) {
+        engine->set_config(pr2_search::LAZY_GBFS_PREFERRED);
+        engine->search();
+        PR2().weaksearch.num_searches++;
+        plan_found = engine->found_solution() && take_plan(engine->get_plan());
+        return;
+    }
+
+    if (PR2().weaksearch.portfolio_wins.empty())
+        PR2().weaksearch.portfolio_wins.assign(pr2_search::NUM_WEAK_PLANNER_CONFIGS, 0);
+
+    vector<int> order;
+    for (int config = 0; config < pr2_search::NUM_WEAK_PLANNER_CONFIGS; config++)
+        order.push_back(config);
+    stable_sort(order.begin(), order.end(), [](int a, int b) {
+        return PR2().weaksearch.portfolio_wins[a] > PR2().weaksearch.portfolio_wins[b];
+    });
+
+    int winner = engine->race(order, PR2().weaksearch.portfolio_budget, [this](const DeterministicPlan &p) {
+        const PR2State *goal = active_goal;
+        if (!take_plan(p))
+            return false;
+        if (check_1safe())
+            return true;
+        // check_1safe plans for the original goal, but the race goes on
+        //  with the goal it was started with
+        PR2().proxy->set_goal(*goal);
+        active_goal = goal;
+        return false;
+    });
+
+    if (-1 != winner) {
+        PR2().weaksearch.portfolio_wins[winner]++;
+        plan_found = plan_checked = true;
+        return;
+    }
+
+    engine->set_config(order[0]);
+    engine->search();
+    PR2().weaksearch.num_searches++;
+    plan_found = engine->found_solution() && take_plan(engine->get_plan());
+    if (plan_found)
+        PR2().weaksearch.portfolio_wins[order[0]]++;
+}
+
 void Simulator::search() {
     // First set the new initial state
-    PR2.proxy->set_initial_state(*current_state);
+    PR2().proxy->set_initial_state(*current_state);
 
-    if (PR2.logging.verbose) {
+    if (PR2().logging.verbose) {
         cout << "\nPlanning for initial state:" << endl;
         current_state->dump_pddl();
         cout << "\n...and goal state:" << endl;
@@ -48,91 +204,99 @@ void Simulator::search() {
         cout << endl;
     }
 
-    // Finally, solve the problem
-    engine->search();
-    PR2.weaksearch.num_searches++;
+    plan_checked = false;
+
+    // A plan from an earlier round may still do the job
+    if (PR2().weaksearch.plan_cache && find_cached_plan())
+        return;
+
+    // Finally, solve the problem. With stop_on_policy the search already
+    //  ends where the policy takes over (see
+    //  DeadendAwareSuccessorGenerator::stop_at_policy).
+    cache_hit = nullptr;
+    run_weak_search();
 }
 
 bool Simulator::simulate_policy(Solution *sol, PR2State * init) {
 
-    setup_simulation(init);
+    PR2State *curr = &trial_state;
+    PR2State *next = &trial_next;
+    *curr = init ? *init : PR2().proxy->get_orig_initial_state();
 
-    PR2State * tmp;
-
-    SolutionStep * step = sol->get_step(*current_state);
+    SolutionStep * step = sol->get_step(*curr);
     last_run_count = 0;
 
-    while (step && (last_run_count < PR2.simulator.trial_depth)) {
+    while (step && (last_run_count < PR2().simulator.trial_depth)) {
 
         last_run_count++;
 
-        if (step->is_goal) {
-            delete current_state;
+        if (step->is_goal)
             return true;
-        }
 
-        tmp = current_state->progress(pick_action(step));
-        delete current_state;
-        current_state = tmp;
-        step = sol->get_step(*current_state);
+        curr->progress(pick_action(step), *next);
+        swap(curr, next);
+        step = sol->get_step(*curr);
     }
 
-    last_run_hit_depth = (last_run_count >= PR2.simulator.trial_depth);
+    last_run_hit_depth = (last_run_count >= PR2().simulator.trial_depth);
 
-    delete current_state;
     return false;
 }
 
 bool Simulator::simulate_graph(Solution *sol, PR2State * init) {
 
-    setup_simulation(init);
-
-    SolutionStep * step = sol->get_step(*current_state);
-    delete current_state;
+    SolutionStep * step = sol->get_step(init ? *init : PR2().proxy->get_orig_initial_state());
     last_run_count = 0;
 
-    while (step && (last_run_count < PR2.simulator.trial_depth)) {
+    while (step && (last_run_count < PR2().simulator.trial_depth)) {
         last_run_count++;
         if (step->is_goal)
             return true;
-        step = step->get_successor(PR2.rng.random(step->get_successors().size()));
+        step = step->get_successor(PR2().rng.random(step->get_successors().size()));
     }
 
-    last_run_hit_depth = (last_run_count >= PR2.simulator.trial_depth);
+    last_run_hit_depth = (last_run_count >= PR2().simulator.trial_depth);
 
     return false;
 }
 
 bool Simulator::simulate_solution(Solution *sol, PR2State * init) {
-    setup_simulation(init);
 
-    PR2State * tmp;
+    bool success = simulate_solution(sol, init ? *init : PR2().proxy->get_orig_initial_state(),
+                                     PR2().rng, trial_state, trial_next, last_run_count);
 
-    SolutionStep * step = sol->get_step(*current_state);
-    last_run_count = 0;
+    last_run_hit_depth = !success && (last_run_count >= PR2().simulator.trial_depth);
 
-    while (step && (last_run_count < PR2.simulator.trial_depth)) {
+    return success;
+}
 
-        last_run_count++;
+bool Simulator::simulate_solution(Solution *sol, const PR2State &init, utils::RandomNumberGenerator &rng,
+                                  PR2State &buffer1, PR2State &buffer2, int &run_count) {
+
+    PR2State *curr = &buffer1;
+    PR2State *next = &buffer2;
+    *curr = init;
+
+    SolutionStep * step = sol->get_step(*curr);
+    run_count = 0;
 
-        if (step->is_goal) {
-            delete current_state;
+    while (step && (run_count < PR2().simulator.trial_depth)) {
+
+        run_count++;
+
+        if (step->is_goal)
             return true;
-        }
 
-        int choice = PR2.rng.random(step->get_successors().size());
-        tmp = current_state->progress(pick_action(step, choice));
-        delete current_state;
-        current_state = tmp;
+        int choice = rng.random(step->get_successors().size());
+        curr->progress(PR2().task->actions.get_outcomes(step->op.nondet_index)[choice], *next);
+        swap(curr, next);
 
         step = step->get_successor(choice);
         if (!step)
-            step = sol->get_step(*current_state);
-        assert((!step) || (current_state->entails(*(step->state))));
+            step = sol->get_step(*curr);
+        assert((!step) || (curr->entails(*(step->state))));
     }
 
-    last_run_hit_depth = (last_run_count >= PR2.simulator.trial_depth);
-
     return false;
 }
 
@@ -141,16 +305,16 @@ void Simulator::run_trials() {
     int succ=0, fail=0, depth=0;
     double succ_avg_depth=0.0, fail_avg_depth=0.0;
 
-    for (int i = 0; i < PR2.simulator.num_trials; i++) {
-        if (simulate_solution(PR2.solution.incumbent)) {
+    for (int i = 0; i < PR2().simulator.num_trials; i++) {
+        if (simulate_solution(PR2().solution.incumbent)) {
             succ++;
-            succ_avg_depth += double(last_run_count) / double(PR2.simulator.num_trials);
+            succ_avg_depth += double(last_run_count) / double(PR2().simulator.num_trials);
         } else {
             if (last_run_hit_depth)
                 depth++;
             else {
                 fail++;
-                fail_avg_depth += double(last_run_count) / double(PR2.simulator.num_trials);
+                fail_avg_depth += double(last_run_count) / double(PR2().simulator.num_trials);
             }
         }
     }
@@ -160,8 +324,8 @@ void Simulator::run_trials() {
     cout << "\t\t--------------------------------------" << endl;
     cout << "\t\t      { Simulation Statistics }" << endl;
     cout << "\t\t--------------------------------------\n" << endl;
-    cout << "                          Trials: " << PR2.simulator.num_trials << endl;
-    cout << "                           Depth: " << PR2.simulator.trial_depth << endl;
+    cout << "                          Trials: " << PR2().simulator.num_trials << endl;
+    cout << "                           Depth: " << PR2().simulator.trial_depth << endl;
     cout << "                         Success: " << succ << "\t (" << (100.0 * double(succ) / double(succ+depth+fail)) << " %)" << endl;
     cout << "                        Failures: " << (fail+depth) << "\t (" << (100.0 * double(depth+fail) / double(succ+depth+fail)) << " %)" << endl;
     cout << endl;
@@ -176,7 +340,7 @@ void Simulator::run_trials() {
 
 bool Simulator::check_1safe() {
 
-    if (!PR2.deadend.enabled)
+    if (!PR2().deadend.enabled)
         return true;
 
     // We need to reset in order to get reliable deadend detection
@@ -190,20 +354,20 @@ bool Simulator::check_1safe() {
     //  then we should at least check the first action. In particular, we don't
     //  want the first action in the plan to end up being forbidden.
     unsigned safe_checks = 1;
-    if (PR2.deadend.force_1safe_weak_plans)
-        safe_checks = engine->get_plan().size();
+    if (PR2().deadend.force_1safe_weak_plans)
+        safe_checks = plan.size();
 
     for (unsigned i = 0; i < safe_checks; i++) {
-        const PR2OperatorProxy op = PR2.proxy->get_operators()[engine->get_plan()[i]];
+        const PR2OperatorProxy op = PR2().proxy->get_operators()[plan[i]];
         vector<NondetSuccessor *> successors;
         new_s = generate_nondet_successors(old_s, &op, successors);
 
         for (auto succ : successors) {
             if (is_deadend(*(succ->state))) {
                 PR2State * new_dead_state = new PR2State(*(succ->state));
-                int op_ind = PR2.general.nondet_mapping[op.nondet_index][succ->id];
-                const PR2OperatorProxy bad_op = PR2.proxy->get_operators()[op_ind];
-                if (PR2.deadend.generalize)
+                int op_ind = PR2().task->actions.get_outcomes(op.nondet_index)[succ->id];
+                const PR2OperatorProxy bad_op = PR2().proxy->get_operators()[op_ind];
+                if (PR2().deadend.generalize)
                     generalize_deadend(*new_dead_state);
                 new_deadends.push_back(new DeadendTuple(new_dead_state, new PR2State(*old_s), &bad_op));
             }
@@ -218,37 +382,47 @@ bool Simulator::check_1safe() {
     }
 
     if (new_deadends.size() > 0) {
-        if (PR2.logging.deadends)
+        if (PR2().logging.deadends)
             cout << "Found " << new_deadends.size() << " new deadends during 1-safe checking!" << endl;
         update_deadends(new_deadends);
+
+        // Don't let the same cached plan come back
+        if (cache_hit)
+            cache_hit->is_active = false;
+
         return false;
     }
 
     // As a sanity check, make sure that we aren't forbidding the first action
     //  in the plan.
-    assert(!is_forbidden(*current_state, PR2.proxy->get_operators()[engine->get_plan()[0]]));
+    assert(!is_forbidden(*current_state, PR2().proxy->get_operators()[plan[0]]));
 
     return true;
 }
 
 SolutionStep* Simulator::record_plan() {
 
-    if (PR2.logging.simulator)
-        cout << "SIMULATOR(" << PR2.logging.id() << "): Recording the found plan." << endl;
+    if (PR2().logging.simulator)
+        cout << "SIMULATOR(" << PR2().logging.id() << "): Recording the found plan." << endl;
 
     // Reset the global goal
     reset_goal();
 
     // Incorporate the new plan, and return the first SolutionStep constructed
-    return PR2.solution.incumbent->incorporate_plan(engine->get_plan(),
-                                                    current_state,
-                                                    PR2.general.matched_step);
+    SolutionStep *first = PR2().solution.incumbent->incorporate_plan(plan,
+                                                                   current_state,
+                                                                   PR2().general.matched_step);
+
+    if (PR2().weaksearch.plan_cache && !cache_hit)
+        plan_cache.add_item(new CachedPlan(new PR2State(*(first->state)), plan, *active_goal));
+
+    return first;
 }
 
 SolutionStep* Simulator::replan() {
 
     // If the policy is complete, searching further won't help us
-    if (PR2.solution.incumbent->is_strong_cyclic()) {
+    if (PR2().solution.incumbent->is_strong_cyclic()) {
         cout << "Error: Trying to replan with a strong cyclic incumbent." << endl;
         exit(0);
     }
@@ -259,8 +433,8 @@ SolutionStep* Simulator::replan() {
     }
 
     // If we are detecting deadends, and know this is one, don't even try
-    if (PR2.deadend.enabled)
-        if (PR2.deadend.states->check_entailed_match(*current_state))
+    if (PR2().deadend.enabled)
+        if (PR2().deadend.states->check_entailed_match(*current_state))
             return nullptr;
 
     // If we can detect that this is a deadend for the original goal, forget about it
@@ -268,43 +442,43 @@ SolutionStep* Simulator::replan() {
         return nullptr;
 
     // Will hold later only if no plan works, and we want to plan locally
-    bool try_again = PR2.localize.enabled;
-    if (try_again && PR2.localize.limited) {
-        PR2.weaksearch.limit_states = true;
-        PR2.weaksearch.max_states = PR2.localize.max_states;
+    bool try_again = PR2().localize.enabled;
+    if (try_again && PR2().localize.limited) {
+        PR2().weaksearch.limit_states = true;
+        PR2().weaksearch.max_states = PR2().localize.max_states;
     }
 
-    if (PR2.logging.simulator)
-        cout << "SIMULATOR(" << PR2.logging.id() << "): Trying to plan initially" << endl;
+    if (PR2().logging.simulator)
+        cout << "SIMULATOR(" << PR2().logging.id() << "): Trying to plan initially" << endl;
 
     set_local_goal();
     search();
 
-    while (engine->found_solution() && !check_1safe()) {
+    while (plan_found && !plan_checked && !check_1safe()) {
         // We need to reset the local goal since the check_1safe resets it
         //  to the original for proper deadend detection
         set_local_goal();
         search();
     }
 
-    PR2.weaksearch.limit_states = false;
+    PR2().weaksearch.limit_states = false;
 
-    if (engine->found_solution())
+    if (plan_found)
         return record_plan();
 
     reset_goal(); // Note that if record_plan() was called, then so was reset_goal()
 
     if (try_again) {
 
-        if (PR2.logging.simulator)
-            cout << "SIMULATOR(" << PR2.logging.id() << "): Trying to plan again" << endl;
+        if (PR2().logging.simulator)
+            cout << "SIMULATOR(" << PR2().logging.id() << "): Trying to plan again" << endl;
 
         search();
 
-        while (engine->found_solution() && !check_1safe())
+        while (plan_found && !plan_checked && !check_1safe())
             search();
 
-        if (engine->found_solution())
+        if (plan_found)
             return record_plan();
     }
 
@@ -3,25 +3,64 @@
 
 #include "pr2.h"
 #include "expand.h"
+#include "policy.h"
 
 #include "fd_integration/pr2_search_algorithm.h"
 
 class Solution;
 class SolutionStep;
 
+/*******************************************************************
+ * A weak plan the simulator found earlier, kept for later rounds.
+ * The item's state is the plan's regressed precondition (the state
+ * of the first step incorporate_plan built for it), so the plan cache
+ * is a policy that can be queried for the current state directly.
+ *******************************************************************/
+struct CachedPlan : PolicyItem {
+
+    DeterministicPlan plan;
+    PR2State goal; // The goal the plan was found for
+
+    CachedPlan(PR2State *s, const DeterministicPlan &p, const PR2State &g) : PolicyItem(s), plan(p), goal(g) {}
+    ~CachedPlan() { delete state; }
+
+    string get_name() { return "cached plan of length " + to_string(plan.size()); }
+    void dump() const;
+};
+
 class Simulator {
 
     PR2State *current_state;
     PR2State *current_goal;
 
+    // The trials progress between these two, rather than allocating a
+    //  new state for every step
+    PR2State trial_state;
+    PR2State trial_next;
+
+    PR2State original_goal; // PR2().task->original_goal as a state
+    const PR2State *active_goal; // The goal the weak search is currently given
+
+    DeterministicPlan plan; // The last plan found (by the weak search or the plan cache)
+    bool plan_found = false;
+    bool plan_checked = false; // Set when the plan already passed check_1safe (in the portfolio)
+
+    Policy plan_cache; // Every plan that was recorded, indexed by its regressed precondition
+    CachedPlan *cache_hit = nullptr; // The cached plan being used (if any)
+
+    bool follow_plan(DeterministicPlan &p, SolutionStep *&matched);
+    bool find_cached_plan();
+    bool take_plan(const DeterministicPlan &p);
+
+    void run_weak_search();
     void search();
-    void setup_simulation(PR2State *cur = nullptr);
     void reset_goal();
     void set_local_goal();
     bool check_1safe();
     SolutionStep* record_plan();
 
-    const PR2OperatorProxy pick_action(SolutionStep *step, int index = -1);
+    // Returns the id of the deterministic operator for the chosen outcome
+    int pick_action(SolutionStep *step, int index = -1);
 
     bool last_run_hit_depth = false;
     int last_run_count = 0;
@@ -37,10 +76,18 @@ public:
     bool simulate_graph(Solution *sol, PR2State *cur = nullptr);
     bool simulate_solution(Solution *sol, PR2State *cur = nullptr);
 
+    // Runs a single simulate_solution trial from init with the given RNG and
+    //  buffers (so it can be used from several threads at once). The number
+    //  of steps taken is put in run_count.
+    static bool simulate_solution(Solution *sol, const PR2State &init, utils::RandomNumberGenerator &rng,
+                                  PR2State &buffer1, PR2State &buffer2, int &run_count);
+
     void run_trials();
 
     SolutionStep* replan();
 
+    const DeterministicPlan & get_plan() const { return plan; }
+
     void set_state(PR2State * s) { current_state = s; }
     void set_goal(PR2State * s) { current_goal = s; }
 
@@ -4,6 +4,10 @@
 #include "partial_state_graph.h"
 #include "simulator.h"
 
+#include <cmath>
+#include <future>
+#include <limits>
+
 SolutionStep::SolutionStep(PR2State *s, PSGraph *psg, int d, const PR2OperatorProxy o, int exid, bool is_r, bool is_g, bool is_s) :
                 PolicyItem(s),
                 containing_graph(psg),
@@ -13,27 +17,27 @@ SolutionStep::SolutionStep(PR2State *s, PSGraph *psg, int d, const PR2OperatorPr
                 is_goal(is_g),
                 is_sc(is_s),
                 expected_id(exid),
-                step_id(PR2.solution.num_steps_created++)
+                step_id(PR2().solution.num_steps_created++)
 {
     // Resize the successors to the right number of outcomes. Change
     //  this if you have a complex nondet successor function in the
     //  expand.* files.
     if (!is_g)
-        succ.resize(PR2.general.nondet_mapping[op.nondet_index].size(), nullptr);
+        succ.resize(PR2().task->actions.get_outcomes(op.nondet_index).size(), nullptr);
     // Inform the PSGraph that we've created another SolutionStep
     containing_graph->add_step(this);
 
     #ifndef NDEBUG
-    if (PR2.logging.log_solstep(step_id))
-        cout << "\nSOLSTEP(" << PR2.logging.id() << "): Created new step " << step_id << endl;
+    if (PR2().logging.log_solstep(step_id))
+        cout << "\nSOLSTEP(" << PR2().logging.id() << "): Created new step " << step_id << endl;
     #endif
 }
 
 SolutionStep* SolutionStep::copy() {
 
     #ifndef NDEBUG
-    if (PR2.logging.log_solstep(step_id))
-        cout << "\nSOLSTEP(" << PR2.logging.id() << "): Copying " << step_id << endl;
+    if (PR2().logging.log_solstep(step_id))
+        cout << "\nSOLSTEP(" << PR2().logging.id() << "): Copying " << step_id << endl;
     #endif
 
     return new SolutionStep(new PR2State(*state),
@@ -91,6 +95,20 @@ bool SolutionStep::operator< (const SolutionStep& other) const {
         return step_id > other.step_id;
 }
 
+void SolutionStep::mark_sc() {
+    if (!is_sc) {
+        is_sc = true;
+        if (containing_graph->policy)
+            containing_graph->policy->rank_changed(this);
+    }
+}
+
+void SolutionStep::deactivate() {
+    is_active = false;
+    if (containing_graph->policy)
+        containing_graph->policy->rank_changed(this);
+}
+
 void SolutionStep::strengthen(PR2State *context) {
 
     // Essentially, this method will fill in undefined variable settings
@@ -106,7 +124,7 @@ void SolutionStep::strengthen(PR2State *context) {
 
     // Fetch all of the forbidden items from this context state
     vector<FSAP *> reg_items;
-    PR2.deadend.policy->generate_consistent_items<FSAP>(*state, reg_items, false);
+    PR2().deadend.policy->generate_consistent_items<FSAP>(*state, reg_items, false);
 
     // Each item could potentially be a forbidden state-action pair
     for (auto fsap : reg_items) {
@@ -114,7 +132,7 @@ void SolutionStep::strengthen(PR2State *context) {
         // If this holds, then we may trigger the forbidden pair
         if (fsap->get_index() == op.nondet_index) {
 
-            for (unsigned j = 0; j < PR2.general.num_vars; j++) {
+            for (unsigned j = 0; j < PR2().task->num_vars; j++) {
 
                 int val = (*(fsap->state))[j];
 
@@ -160,12 +178,12 @@ void SolutionStep::validate(set< PR2SearchNode * > &matching_nodes) {
             outcome += 1;
             if (succss) {
 
-                int op_ind = PR2.general.nondet_mapping[op.nondet_index][outcome];
-                PR2OperatorProxy used_op = PR2.proxy->get_operators()[op_ind];
+                int op_ind = PR2().task->actions.get_outcomes(op.nondet_index)[outcome];
+                PR2OperatorProxy used_op = PR2().proxy->get_operators()[op_ind];
                 bool failed = !(state->entails(*(succss->state->regress(used_op, searchnode->full_state))));
 
-                if (failed || PR2.logging.network_assertions) {
-                    cout << "\nVALIDATIONS(" << PR2.logging.id() << "): Regressing solstep <dst> to <src> with <op> and associated <state> / <search node>:\n" << endl;
+                if (failed || PR2().logging.network_assertions) {
+                    cout << "\nVALIDATIONS(" << PR2().logging.id() << "): Regressing solstep <dst> to <src> with <op> and associated <state> / <search node>:\n" << endl;
                     cout << "----{ dst }----\n" << endl;
                     succss->dump();
                     cout << "----{ src }----\n" << endl;
@@ -210,8 +228,8 @@ void SolutionStep::record_snapshot(ofstream &outfile, string indent) {
         if (i != 0)
             outfile << "," << endl;
         outfile << indent << "    {" << endl;
-        int op_ind = PR2.general.nondet_mapping[op.nondet_index][i++];
-        outfile << indent << "        \"outcome_label\": \"" << PR2.proxy->get_operators()[op_ind].get_name() << "\"," << endl;
+        int op_ind = PR2().task->actions.get_outcomes(op.nondet_index)[i++];
+        outfile << indent << "        \"outcome_label\": \"" << PR2().proxy->get_operators()[op_ind].get_name() << "\"," << endl;
         outfile << indent << "        \"successor_id\": ";
         if (s)
             outfile << "\"" << s->step_id << "\"" << endl;
@@ -226,16 +244,18 @@ void SolutionStep::record_snapshot(ofstream &outfile, string indent) {
 
 Solution::Solution(Simulator *sim) {
     simulator = sim;
-    score = 0.0;
+    reset_score();
     network = new PSGraph();
     policy = new Policy();
+    policy->set_ranking<SolutionStep>(SolutionStepCompare());
+    network->policy = policy;
 
     // Create an initial default goal solution step
     PR2State * gs = new PR2State();
-    for (auto goal_tuple : PR2.localize.original_goal)
+    for (auto goal_tuple : PR2().task->original_goal)
         (*gs)[goal_tuple.first] = goal_tuple.second;
 
-    SolutionStep * gss = new SolutionStep(gs, network, 0, *(PR2.general.goal_op), -1, true, true, true);
+    SolutionStep * gss = new SolutionStep(gs, network, 0, *(PR2().task->goal_op), -1, true, true, true);
     policy->add_item(gss);
     network->goal = gss;
 }
@@ -251,34 +271,23 @@ PR2OperatorProxy Solution::get_action(const PR2State &state, bool avoid_forbidde
 
 SolutionStep * Solution::get_step(const PR2State &state, bool avoid_forbidden) {
 
-    vector<SolutionStep *> items;
-    policy->generate_entailed_items<SolutionStep>(state, items);
+    SolutionStep * best = nullptr;
+    SolutionStepCompare better;
 
-    if (items.empty())
-        return nullptr;
-
-    SolutionStep * best;
     if (avoid_forbidden) {
 
-        vector<OperatorID> ops;
-        PR2.generate_fsap_aware_applicable_ops(state, ops);
-        set<int> opset;
-        for (auto oid : ops)
-            opset.insert(oid.get_index());
-        
-
-        vector<SolutionStep *> non_forbidden_items;
-        for (auto item : items) {
-            if (item->is_goal || (opset.find(item->op.get_id()) != opset.end())) {
-                non_forbidden_items.push_back(item);
-            }
-        }
+        // The filter is only called on steps that would beat the best so
+        //  far, so just the candidates' actions get checked against the
+        //  FSAPs (an entailed step's action is always applicable)
+        best = policy->find_best_entailed_item<SolutionStep>(state, better,
+            [&state](SolutionStep *item) {
+                return item->is_goal || !is_forbidden(state, item->op.nondet_index);
+            });
 
-        if (non_forbidden_items.empty())
-            return nullptr;
-        best = *(min_element(non_forbidden_items.begin(), non_forbidden_items.end(), SolutionStepCompare()));
-    } else
-        best = *(min_element(items.begin(), items.end(), SolutionStepCompare()));
+    } else {
+        best = policy->find_best_entailed_item<SolutionStep>(state, better,
+            [](SolutionStep *) { return true; });
+    }
 
     if (best && best->is_active)
         return best;
@@ -286,31 +295,322 @@ SolutionStep * Solution::get_step(const PR2State &state, bool avoid_forbidden) {
     return nullptr;
 }
 
+/*******************************************************************
+ * Monte Carlo evaluation. The trials are split into one contiguous
+ * shard per worker, and each worker has its own RNG (seeded from
+ * PR2().rng before any thread starts) and its own pair of state
+ * buffers for Simulator::simulate_solution. The score only depends on the seed and the number of
+ * threads, and the workers only ever read the policy and the FSAPs.
+ *******************************************************************/
+
+static const int MIN_TRIALS_PER_WORKER = 64; // Fewer trials than this aren't worth a thread
+
+// Runs the trials and returns how many of them reached the goal
+int Solution::simulate_trials(int num_trials) {
+
+    int num_workers = max(1, min(PR2().general.num_threads, num_trials / MIN_TRIALS_PER_WORKER));
+
+    const PR2State &init = PR2().proxy->get_orig_initial_state();
+
+    vector<int> seeds;
+    for (int w = 0; w < num_workers; w++)
+        seeds.push_back(PR2().rng.random(numeric_limits<int>::max()));
+
+    vector<int> succeeded(num_workers, 0);
+    PR2Wrapper &context = PR2();
+    auto run_shard = [this, &context, &init, num_trials, num_workers, &seeds, &succeeded](int w) {
+        PR2ContextBinding binding(context);
+        utils::RandomNumberGenerator rng(seeds[w]);
+        PR2State buffer1(init), buffer2(init);
+        int count = 0, run_count;
+        int end = (long long)num_trials * (w + 1) / num_workers;
+        for (int i = (long long)num_trials * w / num_workers; i < end; i++)
+            if (Simulator::simulate_solution(this, init, rng, buffer1, buffer2, run_count))
+                count++;
+        succeeded[w] = count;
+    };
+
+    vector< future<void> > workers;
+    for (int w = 1; w < num_workers; w++)
+        workers.push_back(async(launch::async, run_shard, w));
+    run_shard(0);
+    for (auto &worker : workers)
+        worker.get();
+
+    int total = 0;
+    for (int count : succeeded)
+        total += count;
+    return total;
+}
+
+void Solution::reset_score() {
+    score = 0.0;
+    trials = 0;
+    successes = 0;
+    exact_score = false;
+    expected_steps = -1.0;
+}
+
+void Solution::add_trials(int num_trials) {
+    successes += simulate_trials(num_trials);
+    trials += num_trials;
+    score = double(successes) / double(trials);
+}
+
 void Solution::evaluate_random() {
-    int succeeded = 0;
-    for (int i = 0; i < PR2.solution.evaluation_trials; i++)
-        if (simulator->simulate_solution(this))
-            succeeded++;
-    score = double(succeeded) / double(PR2.solution.evaluation_trials);
+    trials = 0;
+    successes = 0;
+    add_trials(PR2().solution.evaluation_trials);
+}
+
+/*******************************************************************
+ * Exact evaluation. Following the successor links of the steps is
+ * the same walk the simulator takes, so from the initial step the
+ * policy is an absorbing Markov chain over the reachable steps (goal
+ * steps absorb and every outcome is equally likely). The chance of
+ * reaching the goal is the least solution of
+ *      P(goal) = 1,  P(s) = mean of P(s') over the successors s'
+ * Steps that can't reach a goal step are exactly 0 and steps that
+ * can't reach a failing one are exactly 1, so only the remaining
+ * steps are solved for, with Gauss-Seidel sweeps until no value
+ * moves by more than the tolerance. The expected number of steps to
+ * the goal (for the walks that reach it) then solves
+ *      E(goal) = 0,  E(s) = 1 + sum of P(s') E(s') / (n_s P(s))
+ * over the steps with P(s) > 0, which is swept the same way.
+ * Unlike a trial, the walk has no depth limit, so for policies that
+ * need close to trial_depth steps the score is higher than what the
+ * simulator estimates (the option is off by default for this reason).
+ * This is only exact if every reachable link is set: a missing link
+ * makes the simulator look the step up from the concrete state, which
+ * the chain doesn't track, so we give up and let the caller simulate.
+ * The same goes for a solve that doesn't converge.
+ *******************************************************************/
+
+static const double EXACT_EVALUATION_TOLERANCE = 1e-9;
+static const int EXACT_EVALUATION_MAX_SWEEPS = 100000;
+
+bool Solution::evaluate_exact() {
+
+    PR2State *init = PR2().proxy->generate_new_init();
+    SolutionStep *start = get_step(*init);
+    delete init;
+
+    if (!start || start->is_goal) {
+        score = start ? 1.0 : 0.0;
+        expected_steps = start ? 0.0 : -1.0;
+        return true;
+    }
+
+    // Collect the reachable steps (in BFS order from the start)
+    vector<SolutionStep *> steps;
+    vector<int> index(PR2().solution.num_steps_created, -1);
+    steps.push_back(start);
+    index[start->step_id] = 0;
+
+    vector<int> succ_begin; // Offsets into succ_ids (one extra at the end)
+    vector<int> succ_ids; // Indices of every step's successors (empty for goal steps)
+
+    for (unsigned i = 0; i < steps.size(); i++) {
+        succ_begin.push_back(succ_ids.size());
+        if (steps[i]->is_goal)
+            continue;
+        for (auto succ : steps[i]->get_successors()) {
+            if (!succ)
+                return false;
+            if (-1 == index[succ->step_id]) {
+                index[succ->step_id] = steps.size();
+                steps.push_back(succ);
+            }
+            succ_ids.push_back(index[succ->step_id]);
+        }
+    }
+    succ_begin.push_back(succ_ids.size());
+
+    // Reverse links, so we can work back from the goal / failing steps
+    vector<int> pred_begin(steps.size() + 1, 0);
+    for (int s : succ_ids)
+        pred_begin[s + 1]++;
+    for (unsigned i = 0; i < steps.size(); i++)
+        pred_begin[i + 1] += pred_begin[i];
+    vector<int> pred_ids(succ_ids.size());
+    vector<int> pred_fill(pred_begin.begin(), pred_begin.end() - 1);
+    for (unsigned i = 0; i < steps.size(); i++)
+        for (int j = succ_begin[i]; j < succ_begin[i + 1]; j++)
+            pred_ids[pred_fill[succ_ids[j]]++] = i;
+
+    auto mark_predecessors = [&](vector<bool> &marked, vector<int> &queue) {
+        for (unsigned q = 0; q < queue.size(); q++) {
+            for (int j = pred_begin[queue[q]]; j < pred_begin[queue[q] + 1]; j++) {
+                if (!marked[pred_ids[j]]) {
+                    marked[pred_ids[j]] = true;
+                    queue.push_back(pred_ids[j]);
+                }
+            }
+        }
+    };
+
+    vector<bool> can_succeed(steps.size(), false);
+    vector<int> succeeding; // Nearest to the goal first
+    for (unsigned i = 0; i < steps.size(); i++) {
+        if (steps[i]->is_goal) {
+            can_succeed[i] = true;
+            succeeding.push_back(i);
+        }
+    }
+    mark_predecessors(can_succeed, succeeding);
+
+    vector<bool> can_fail(steps.size(), false);
+    vector<int> failing;
+    for (unsigned i = 0; i < steps.size(); i++) {
+        if (!can_succeed[i]) {
+            can_fail[i] = true;
+            failing.push_back(i);
+        }
+    }
+    mark_predecessors(can_fail, failing);
+
+    vector<double> prob(steps.size(), 0.0);
+    vector<int> order; // Steps to sweep, nearest to the goal first
+    for (int i : succeeding) {
+        if (!can_fail[i])
+            prob[i] = 1.0;
+        else
+            order.push_back(i);
+    }
+
+    auto sweep_until_converged = [&](vector<double> &value, const vector<int> &sweep_order, auto update) {
+        for (int sweep = 0; sweep < EXACT_EVALUATION_MAX_SWEEPS; sweep++) {
+            double change = 0.0;
+            for (int i : sweep_order) {
+                double updated = update(i);
+                change = max(change, abs(updated - value[i]) / max(1.0, updated));
+                value[i] = updated;
+            }
+            if (change < EXACT_EVALUATION_TOLERANCE)
+                return true;
+        }
+        return false;
+    };
+
+    bool converged = sweep_until_converged(prob, order, [&](int i) {
+        double total = 0.0;
+        for (int j = succ_begin[i]; j < succ_begin[i + 1]; j++)
+            total += prob[succ_ids[j]];
+        return total / double(succ_begin[i + 1] - succ_begin[i]);
+    });
+    if (!converged)
+        return false;
+
+    // Every step that can reach the goal, other than the goal steps
+    vector<int> e_order;
+    for (int i : succeeding)
+        if (!steps[i]->is_goal)
+            e_order.push_back(i);
+
+    vector<double> steps_to_goal(steps.size(), 0.0);
+    converged = sweep_until_converged(steps_to_goal, e_order, [&](int i) {
+        double total = 0.0;
+        for (int j = succ_begin[i]; j < succ_begin[i + 1]; j++)
+            total += prob[succ_ids[j]] * steps_to_goal[succ_ids[j]];
+        return 1.0 + total / (double(succ_begin[i + 1] - succ_begin[i]) * prob[i]);
+    });
+    if (!converged)
+        return false;
+
+    score = prob[0];
+    expected_steps = (prob[0] > 0.0) ? steps_to_goal[0] : -1.0;
+    return true;
 }
 
 void Solution::evaluate() {
     if (1.0 <= score)
         return;
+    if (PR2().solution.exact_evaluation && evaluate_exact()) {
+        exact_score = true;
+        return;
+    }
     evaluate_random();
 }
 
 double Solution::get_score() {
-    if (0.0 == score)
+    if ((0.0 == score) && (0 == trials) && !exact_score)
         evaluate();
     return min(score, 1.0);
 }
 
+// Tries the exact evaluation if nothing is known about the score yet
+bool Solution::has_exact_score() {
+    if (!exact_score && (0 == trials) && PR2().solution.exact_evaluation)
+        exact_score = evaluate_exact();
+    return exact_score;
+}
+
+double Solution::get_expected_steps() {
+    return has_exact_score() ? expected_steps : -1.0;
+}
+
+/*******************************************************************
+ * Sequential comparison. Rather than running the full set of trials
+ * on both policies, the ones without an exact score are simulated a
+ * batch at a time until the Hoeffding intervals around the two
+ * scores stop overlapping, or every sampled policy hits the cap. The
+ * allowed error is split over every interval we could look at, so
+ * peeking after each batch doesn't weaken the confidence.
+ *******************************************************************/
+
+void Solution::compare_sequentially(Solution *other) {
+
+    Solution *sols[2] = {this, other};
+    if (has_exact_score() && other->has_exact_score())
+        return;
+
+    int max_trials = max(PR2().solution.sequential_max_trials, 1);
+    int batch = max(PR2().solution.sequential_batch, 1);
+    int looks = (max_trials + batch - 1) / batch;
+    double delta = (1.0 - PR2().solution.sequential_confidence) / (2.0 * looks);
+
+    PR2().solution.sequential_comparisons++;
+
+    while (true) {
+
+        double lower[2], upper[2];
+        for (int i = 0; i < 2; i++) {
+            double radius = 1.0;
+            if (sols[i]->exact_score)
+                radius = 0.0;
+            else if (sols[i]->trials > 0)
+                radius = sqrt(log(2.0 / delta) / (2.0 * sols[i]->trials));
+            lower[i] = sols[i]->score - radius;
+            upper[i] = sols[i]->score + radius;
+        }
+
+        if ((lower[0] > upper[1]) || (lower[1] > upper[0]))
+            return;
+
+        bool sampled = false;
+        for (auto sol : sols) {
+            if (!sol->exact_score && (sol->trials < max_trials)) {
+                int num_trials = min(batch, max_trials - sol->trials);
+                sol->add_trials(num_trials);
+                PR2().solution.sequential_trials += num_trials;
+                sampled = true;
+            }
+        }
+
+        if (!sampled) {
+            PR2().solution.sequential_capped++;
+            return;
+        }
+    }
+}
+
 int Solution::get_size() {
     return policy->size();
 }
 
 bool Solution::better_than(Solution * other) {
+    if (PR2().solution.sequential_evaluation && other && (other != this))
+        compare_sequentially(other);
     if (get_score() != other->get_score())
         return get_score() > other->get_score();
     else if (is_strong_cyclic() != other->is_strong_cyclic())
@@ -326,14 +626,14 @@ void Solution::rebuild() {
     // Next, rebuild the policy with the relevant (i.e., active) items
     policy->rebuild();
 
-    score = 0.0;
+    reset_score();
 }
 
 SolutionStep* Solution::incorporate_plan(const DeterministicPlan &plan,
                                          PR2State *start_state,
                                          SolutionStep *goal_step) {
 
-    score = 0.0;
+    reset_score();
 
     // Get every complete state going forward for context / strengthening
     vector<PR2State *> states;
@@ -341,7 +641,7 @@ SolutionStep* Solution::incorporate_plan(const DeterministicPlan &plan,
     states.push_back(new PR2State(*start_state));
 
     for (auto op : plan)
-        states.push_back(states.back()->progress(PR2.proxy->get_operators()[op]));
+        states.push_back(states.back()->progress(op.get_index()));
 
     // Do the repeated regression and set up the links for the network
     SolutionStep *succ = goal_step;
@@ -350,9 +650,9 @@ SolutionStep* Solution::incorporate_plan(const DeterministicPlan &plan,
     for (int i = plan.size() - 1; i >= 0; i--) {
 
         // Create the new solution step for this part of the plan
-        PR2State *regrps = succ->state->regress(PR2.proxy->get_operators()[plan[i]], states[i]);
-        int nondet_outcome = PR2.proxy->get_operators()[plan[i]].nondet_outcome;
-        pred = new SolutionStep(regrps, PR2.solution.incumbent->network, succ->distance + 1, PR2.proxy->get_operators()[plan[i]], nondet_outcome);
+        PR2State *regrps = succ->state->regress(PR2().proxy->get_operators()[plan[i]], states[i]);
+        int nondet_outcome = PR2().proxy->get_operators()[plan[i]].nondet_outcome;
+        pred = new SolutionStep(regrps, PR2().solution.incumbent->network, succ->distance + 1, PR2().proxy->get_operators()[plan[i]], nondet_outcome);
         new_steps.push_back(pred);
 
         pred->connect_to_successor(nondet_outcome, succ);
@@ -385,7 +685,7 @@ SolutionStep* Solution::incorporate_plan(const DeterministicPlan &plan,
 
 void Solution::insert_step(SolutionStep * step) {
 
-    score = 0.0;
+    reset_score();
 
     //
     // Nothing to do for the graph
@@ -398,7 +698,7 @@ void Solution::insert_steps(list<PolicyItem *> &steps) {
     if (steps.empty())
         return;
 
-    score = 0.0;
+    reset_score();
 
     //
     // Nothing to do for the graph
@@ -443,7 +743,7 @@ void Solution::clear_dead_solsteps(map< SolutionStep* , set< PR2SearchNode * > *
             solstep2searchnode->erase(s);
         }
         network->remove_step(s);
-        s->is_active = false;
+        s->deactivate();
 
     }
 
@@ -460,7 +760,7 @@ void Solution::record_snapshot(ofstream &outfile, map< SolutionStep* , set< PR2S
     outfile << indent << "  \"type\": \"" << type << "\"," << endl;
     outfile << indent << "  \"score\": " << get_score() << "," << endl;
     outfile << indent << "  \"size\": " << get_size() << "," << endl;
-    outfile << indent << "  \"round\": " << PR2.logging.fond_search_count << "," << endl;
+    outfile << indent << "  \"round\": " << PR2().logging.fond_search_count << "," << endl;
 
     network->record_snapshot(outfile, indent+"  ");
     outfile << "," << endl;
@@ -60,6 +60,11 @@ public:
     void strengthen(PR2State *s);
 
     bool operator< (const SolutionStep& other) const;
+
+    // These change the step's rank, so they go through here to let the
+    //  policy know that its cached best-step ranking needs fixing
+    void mark_sc();
+    void deactivate();
     SolutionStep* copy();
 
     void validate(set< PR2SearchNode * > &matching_nodes);
@@ -85,8 +90,8 @@ public:
     void connect_to_successor(int id, SolutionStep * s) {
 
         #ifndef NDEBUG
-        if (PR2.logging.log_solstep(step_id) || PR2.logging.log_solstep(s->step_id))
-            std::cout << "\nSOLSTEP(" << PR2.logging.id() << "): Connecting " << step_id << " to " << s->step_id << " via " << id << endl;
+        if (PR2().logging.log_solstep(step_id) || PR2().logging.log_solstep(s->step_id))
+            std::cout << "\nSOLSTEP(" << PR2().logging.id() << "): Connecting " << step_id << " to " << s->step_id << " via " << id << endl;
         #endif
 
         set_successor(id, s);
@@ -96,8 +101,8 @@ public:
     void unconnect_from_successor(int id) {
 
         #ifndef NDEBUG
-        if (PR2.logging.log_solstep(step_id) || PR2.logging.log_solstep(succ[id]->step_id))
-            std::cout << "\nSOLSTEP(" << PR2.logging.id() << "): Disconnecting " << step_id << " from " << succ[id]->step_id << " via " << id << endl;
+        if (PR2().logging.log_solstep(step_id) || PR2().logging.log_solstep(succ[id]->step_id))
+            std::cout << "\nSOLSTEP(" << PR2().logging.id() << "): Disconnecting " << step_id << " from " << succ[id]->step_id << " via " << id << endl;
         #endif
 
         assert(has_successor(id));
@@ -119,8 +124,18 @@ class Solution {
     Simulator *simulator;
 
     double score;
-
+    int trials; // Number of simulated trials behind the score (0 if it hasn't been simulated)
+    int successes; // Number of those trials that reached the goal
+    bool exact_score; // The score came from evaluate_exact
+    double expected_steps; // Expected steps to the goal, when it is reached (from evaluate_exact, -1 if unknown)
+
+    void reset_score();
+    int simulate_trials(int num_trials);
+    void add_trials(int num_trials);
     void evaluate_random();
+    bool evaluate_exact();
+    bool has_exact_score();
+    void compare_sequentially(Solution *other);
 
 public:
 
@@ -130,11 +145,12 @@ public:
     Solution(Simulator *sim);
     ~Solution();
 
-    PR2OperatorProxy get_action(const PR2State &state, bool avoid_forbidden = PR2.deadend.enabled);
-    SolutionStep * get_step(const PR2State &state, bool avoid_forbidden = PR2.deadend.enabled);
+    PR2OperatorProxy get_action(const PR2State &state, bool avoid_forbidden = PR2().deadend.enabled);
+    SolutionStep * get_step(const PR2State &state, bool avoid_forbidden = PR2().deadend.enabled);
 
     void evaluate();
     double get_score();
+    double get_expected_steps(); // -1 if there's no exact score
     int get_size();
     bool better_than(Solution * other);
 